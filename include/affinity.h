@@ -0,0 +1,45 @@
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+
+#include <pthread.h>
+
+/********************* [ Helpful Typedefs        ] ************************/
+
+/**
+ * a set of CPU (or NUMA node) numbers, in the order they were listed
+ */
+typedef struct cpu_list
+{
+    int *cpus;
+    int  num_cpus;
+} cpu_list_t;
+
+/**
+ * parses a list such as "0-3,8,10-11", the format of the -I/-W/-E
+ * options and of the cpulist files under /sys
+ * returns 0 on success, -1 if the list is malformed
+ */
+int parse_cpu_list(const char *text, cpu_list_t *list);
+
+/**
+ * fills `nodes` with the online NUMA nodes and `node_cpus` with the
+ * CPUs of each, as reported by /sys/devices/system/node
+ * returns the number of nodes, or 0 if the machine does not report any
+ * NOTE: `*node_cpus` is allocated and must be freed by the caller
+ */
+int numa_topology(cpu_list_t *nodes, cpu_list_t **node_cpus);
+
+/**
+ * restricts `thread` to the CPUs in `list`
+ * returns 0 on success, -1 on failure
+ */
+int bind_thread(pthread_t thread, const cpu_list_t *list);
+
+/**
+ * restricts `thread` to the single CPU at position `slot` of `list`,
+ * wrapping around when there are more threads than CPUs
+ * returns 0 on success, -1 on failure
+ */
+int pin_thread(pthread_t thread, const cpu_list_t *list, int slot);
+
+#endif
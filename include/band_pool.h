@@ -0,0 +1,49 @@
+#ifndef BAND_POOL_H_
+#define BAND_POOL_H_
+
+#include <pthread.h>
+#include "scheduler.h"
+
+/********************* [ Helpful Typedefs        ] ************************/
+
+/**
+ * processes rows [first_row, last_row) of one image; bands of the
+ * same image are run concurrently, so they must not write to each
+ * other's rows
+ */
+typedef void (*band_fn_t)(void *arg, int first_row, int last_row);
+
+typedef struct band_helper
+{
+    pthread_t          thread;
+    int                index;   // the helper's deque in the pool's scheduler
+    struct band_pool  *pool;
+} band_helper_t;
+
+/**
+ * helper threads that split a single image into row bands, so that
+ * one large image can use more than one core; bands are spread over
+ * the helpers' deques and idle helpers steal from busy ones
+ */
+typedef struct band_pool
+{
+    scheduler_t    sched;
+    band_helper_t *helpers;
+    int            num_threads;
+} band_pool_t;
+
+/**
+ * starts `num_threads` helper threads; with 0 helpers every image is
+ * processed by the calling thread alone
+ * returns 0 on success, -1 on failure
+ */
+int band_pool_init(band_pool_t *pool, int num_threads);
+
+/**
+ * runs `fn` over `rows` rows split into at most `num_bands` bands and
+ * returns once every band is done; the caller processes one band itself
+ * and steals more while it waits
+ */
+void band_pool_run(band_pool_t *pool, band_fn_t fn, void *arg, int rows, int num_bands);
+
+#endif
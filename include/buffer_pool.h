@@ -0,0 +1,57 @@
+#ifndef BUFFER_POOL_H_
+#define BUFFER_POOL_H_
+
+#include <stddef.h>
+
+#define BUFFER_POOL_MIN_SHIFT   8     // smallest size class, 256 bytes
+#define BUFFER_POOL_MAX_SHIFT   24    // largest size class, 16 MB; bigger buffers bypass the pool
+#define BUFFER_POOL_NUM_CLASSES (BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1)
+#define BUFFER_POOL_KEEP        256   // most free buffers kept in one size class
+#define BUFFER_POOL_KEEP_BYTES  (64L * 1024 * 1024)   // and at most this much memory in one class
+
+/********************* [ Helpful Typedefs        ] ************************/
+
+// a free buffer, linked through its own first bytes
+typedef struct pool_buffer
+{
+    struct pool_buffer *next;
+} pool_buffer_t;
+
+/**
+ * free buffers of power-of-two size classes, recycled instead of going back to malloc;
+ * a pool is not thread-safe, each thread that allocates on the request path keeps its own
+ * the counters are written only by the owning thread and may be read from any other
+ */
+typedef struct buffer_pool
+{
+    pool_buffer_t *free_lists[BUFFER_POOL_NUM_CLASSES];
+    int            num_free[BUFFER_POOL_NUM_CLASSES];
+    long           gets;        // buffers handed out
+    long           reused;      // of those, taken from a free list
+    long           allocated;   // of those, freshly malloc'd
+    long           released;    // buffers given back to malloc, over the limits or the largest class
+} buffer_pool_t;
+
+/**
+ * starts an empty pool
+ */
+void buffer_pool_init(buffer_pool_t *pool);
+
+/**
+ * returns a buffer of at least `size` bytes, or NULL if malloc fails; its real size is stored in
+ * `*capacity` unless that is NULL
+ */
+void *buffer_pool_get(buffer_pool_t *pool, size_t size, size_t *capacity);
+
+/**
+ * takes back `buffer`; `size` must not exceed the size it was requested with or the capacity it was
+ * given, and a buffer from plain malloc is passed with a `size` of 0 and freed
+ */
+void buffer_pool_put(buffer_pool_t *pool, void *buffer, size_t size);
+
+/**
+ * frees every buffer the pool holds
+ */
+void buffer_pool_destroy(buffer_pool_t *pool);
+
+#endif
@@ -1,7 +1,7 @@
 #ifndef IMAGE_CLIENT_ROTATION_H_
 #define IMAGE_CLIENT_ROTATION_H_
 
-#define _XOPEN_SOURCE
+#define _GNU_SOURCE
 
 #include <string.h>
 #include <stdlib.h>
@@ -20,12 +20,19 @@
 #include <signal.h>
 #include <limits.h>
 #include <stdint.h>
+#include <ctype.h>
 #include "utils.h"
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <endian.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 
 #include "hash.h"
+#include "job_queue.h"
+#include "pack.h"
 
 
 
@@ -37,12 +44,40 @@
 #define MAX_THREADS 100                             //Maximum number of threads
 #define MAX_QUEUE_LEN 100                           //Maximum queue length
 #define PACKET_SIZE 1024
-
-// Operations
-#define IMG_OP_ACK      (1 << 0)
-#define IMG_OP_NAK      (1 << 1)
-#define IMG_OP_ROTATE   (1 << 2)
-#define IMG_OP_EXIT     (1 << 3)
+#define PACKET_V2_MAGIC   0x00495032  // "\0IP2"; no v1 packet starts with a zero byte (operation 0, no flags)
+#define PACKET_V2_VERSION 2
+#define PACKET_V2_SIZE    24
+#define PACKET_V2_MAX_EXT (PACKET_SIZE - PACKET_V2_SIZE)   // extension TLVs the server accepts after a header
+#define PACKET_TLV_RAW_IMAGE 1      // the payload is raw pixels as a packet_raw_image_t describes, and so is the result
+#define NETPBM_HEADER_MAX 512       // bytes of a PGM or PPM file searched for the end of its header
+#define LOCAL_SOCKET_PATH "/tmp/image-processor.sock"
+#define WRITER_QUEUE_LEN 64                         //Results received but not yet saved before the receiver waits
+#define WRITER_BATCH 32                             //Results saved together, and synced together with -F
+#define PACK_FILE_NAME "results.pack"              //Name of the pack written to the output directory with -P
+#define BATCH_MAX_ITEMS 64                          //Most images sent together in one IMG_OP_BATCH
+#define BATCH_MAX_BYTES (512 * 1024)                //Most image bytes sent together in one IMG_OP_BATCH
+#define BATCH_ITEM_MAX_BYTES (64 * 1024)            //Bigger images are always sent on their own
+#define SHM_NUM_SLOTS 8
+#define SHM_SLOT_SIZE (1024 * 1024)
+#define SHM_SLOT_DATA_OFFSET 64     // image bytes start after the slot header, on their own cache line
+
+// Operations: each is its own value, not a flag to combine with others; ACK, NAK, ROTATE and EXIT
+// keep the bit values v1 gave them, and later operations fill 3 and 5-7, then continue from 9
+typedef enum img_op
+{
+    IMG_OP_ACK         = 1,
+    IMG_OP_NAK         = 2,
+    IMG_OP_BUSY        = 3,     // server over its admission limit, size holds a retry-after hint in ms
+    IMG_OP_ROTATE      = 4,
+    IMG_OP_ROTATE_FD   = 5,     // local clients only: rotate the file passed as the first SCM_RIGHTS descriptor into the second
+    IMG_OP_SHM_ATTACH  = 6,     // local clients only: share the memfd passed with SCM_RIGHTS, split into `size` slots
+    IMG_OP_ROTATE_SHM  = 7,     // rotate the image in shared memory slot `size`, writing the result back into it
+    IMG_OP_EXIT        = 8,
+    IMG_OP_STREAM      = 9,     // images follow the packet, each behind a stream_entry_t, until an empty entry
+    IMG_OP_ROTATE_PATH = 10,    // the payload names an input and an output file, each NUL-terminated, under the server's -r root
+    IMG_OP_MULTIPLEX   = 11,    // v2 only: asks for a window of `size` requests in flight, answered as each finishes
+    IMG_OP_BATCH       = 12     // v2 only: the payload holds several images behind a batch_header_t, answered all at once
+} img_op_t;
 
 // Flags
 #define IMG_FLAG_ROTATE_180     (1 << 0)
@@ -59,13 +94,107 @@ typedef struct packet
     unsigned int size;
     unsigned char checksum[SHA256_BLOCK_SIZE];
 } packet_t; 
+// v2 request and response header, in network byte order; `ext_length` bytes of extension TLVs
+// follow it, then the payload
+typedef struct packet_v2
+{
+    uint32_t magic;        // PACKET_V2_MAGIC
+    uint8_t  version;      // PACKET_V2_VERSION
+    uint8_t  operation;
+    uint8_t  flags;
+    uint8_t  reserved;
+    uint32_t request_id;   // echoed in the response
+    uint32_t ext_length;
+    uint64_t size;         // payload length, or the operation's argument as in v1
+} packet_v2_t;
+
+// one extension of a v2 header
+typedef struct packet_tlv
+{
+    uint16_t type;
+    uint16_t length;       // bytes of value after this
+} packet_tlv_t;
+
+// value of a PACKET_TLV_RAW_IMAGE extension, in network byte order on the wire
+typedef struct packet_raw_image
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;     // 1 gray, 2 gray and alpha, 3 RGB or 4 RGBA, 8 bits each; results are always gray
+    uint32_t stride;       // bytes from the start of one row to the next
+} packet_raw_image_t;
+
 
 typedef struct request
 {
     int   angle;
     char *file_name;
+    int   slot;    // shared memory slot the image was sent in, -1 if it went over the socket
 } request_t;
 
+// precedes every image of an IMG_OP_STREAM in both directions, in network byte order;
+// an entry with no name ends the stream
+typedef struct stream_entry
+{
+    uint32_t name_length;   // bytes of file name that follow this header
+    uint32_t size;          // bytes of image that follow the name
+    uint32_t status;        // results only: IMG_OP_ACK, or IMG_OP_NAK with no image
+} stream_entry_t;
+
+// starts an IMG_OP_BATCH payload and its response in network byte order, followed by `count`
+// batch_item_t and then the images they point at
+typedef struct batch_header
+{
+    uint32_t count;
+} batch_header_t;
+
+// one image of a batch, in network byte order
+typedef struct batch_item
+{
+    uint32_t status;        // results only: IMG_OP_ACK, or IMG_OP_NAK with no image
+    uint32_t offset;        // where the image starts, from the start of the payload
+    uint32_t size;
+} batch_item_t;
+
+// what the thread receiving a stream's results needs
+typedef struct stream_args
+{
+    int   socket;
+    char *output_dir;
+    bool  failed;     // set if a result was missing or could not be read
+} stream_args_t;
+
+// what the sender and the receiver of a multiplexed connection share; a request's id is the index
+// its file name waits at until the reply comes back
+typedef struct multiplex_args
+{
+    int             socket;
+    char           *output_dir;
+    char          **names;        // file name of the request in flight under each id, NULL if the id is free
+    int             window;       // ids the server granted
+    int             in_flight;
+    bool            sending_done; // IMG_OP_EXIT is out, or sending gave up
+    bool            broken;       // the receiver lost the connection
+    bool            failed;       // set if an image came back as failed
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;      // an id was freed or taken, or the connection broke
+} multiplex_args_t;
+
+// start of every slot in the memory shared with the server
+typedef struct shm_slot_header
+{
+    uint32_t in_size;    // written by the client before IMG_OP_ROTATE_SHM
+    uint32_t out_size;   // written by the server before its ACK
+} shm_slot_header_t;
+
+// a received result waiting for the writer thread
+typedef struct output
+{
+    char    *path;
+    uint8_t *data;
+    int      size;
+} output_t;
+
 typedef struct request_node
 {
     struct request_node *next;
@@ -114,10 +243,11 @@ void add_request(request_queue_t *queue, char *file_name, int angle);
  */
 request_t *get_request();
 
-// serialize packet
-char *serialize_packet(packet_t *packet);
+// serialize packet into the PACKET_SIZE bytes at `serialized_data`, as a v1 packet or a v2 header
+// returns how many of them are to be sent
+int serialize_packet(packet_t *packet, char *serialized_data);
 
-// deserialize data
-packet_t *deserialize_data(char *serialized_data);
+// deserialize data into `packet`
+void deserialize_data(char *serialized_data, packet_t *packet);
 
 #endif
@@ -0,0 +1,54 @@
+#ifndef JOB_QUEUE_H_
+#define JOB_QUEUE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/********************* [ Helpful Typedefs        ] ************************/
+
+/**
+ * bounded FIFO of opaque work items shared between producer and
+ * consumer threads; producers block while the queue is full and
+ * consumers block while it is empty
+ */
+typedef struct job_queue
+{
+    void          **items;
+    int             capacity;
+    int             head;
+    int             count;
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+} job_queue_t;
+
+/**
+ * initializes `queue` so that it can hold up to `capacity` items
+ * returns 0 on success, -1 on failure
+ */
+int job_queue_init(job_queue_t *queue, int capacity);
+
+/**
+ * releases the resources held by `queue`
+ * NOTE: items still in the queue are not freed
+ */
+void job_queue_destroy(job_queue_t *queue);
+
+/**
+ * appends `item` to the end of the queue, waiting for space
+ * if the queue is full
+ */
+void job_queue_push(job_queue_t *queue, void *item);
+
+/**
+ * removes and returns the item at the front of the queue,
+ * waiting for one to arrive if the queue is empty
+ */
+void *job_queue_pop(job_queue_t *queue);
+
+/**
+ * returns the number of items currently in the queue
+ */
+int job_queue_length(job_queue_t *queue);
+
+#endif
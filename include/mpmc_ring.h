@@ -0,0 +1,93 @@
+#ifndef MPMC_RING_H_
+#define MPMC_RING_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/********************* [ Helpful Typedefs        ] ************************/
+
+typedef struct mpmc_cell
+{
+    unsigned long sequence;   // tells producers and consumers whose turn the cell is
+    void         *item;
+} mpmc_cell_t;
+
+/**
+ * bounded lock-free multi-producer/multi-consumer FIFO of opaque work
+ * items; producers and consumers each claim a cell with a single
+ * compare-and-swap, and only a consumer that finds the ring empty
+ * sleeps, on a futex
+ */
+typedef struct mpmc_ring
+{
+    mpmc_cell_t  *cells;
+    unsigned long mask;          // capacity - 1, the capacity being a power of two
+
+    // the two ends are written by different threads, so keep them on separate cache lines
+    unsigned long enqueue_pos __attribute__((aligned(64)));
+    unsigned long dequeue_pos __attribute__((aligned(64)));
+
+    uint32_t      wake_word __attribute__((aligned(64)));  // futex word, see futex_prepare_wait()
+} mpmc_ring_t;
+
+/**
+ * initializes `ring` to hold at least `capacity` items
+ * returns 0 on success, -1 on failure
+ */
+int mpmc_ring_init(mpmc_ring_t *ring, int capacity);
+
+/**
+ * releases the resources held by `ring`
+ * NOTE: items still in the ring are not freed
+ */
+void mpmc_ring_destroy(mpmc_ring_t *ring);
+
+/**
+ * appends `item` if there is room
+ * returns true on success, false if the ring is full
+ */
+bool mpmc_ring_try_push(mpmc_ring_t *ring, void *item);
+
+/**
+ * removes and returns the oldest item, or `NULL` if the ring is empty
+ */
+void *mpmc_ring_try_pop(mpmc_ring_t *ring);
+
+/**
+ * appends `item`, yielding the CPU while the ring is full, and wakes
+ * a consumer sleeping in `mpmc_ring_pop()`
+ */
+void mpmc_ring_push(mpmc_ring_t *ring, void *item);
+
+/**
+ * removes and returns the oldest item, sleeping while the ring is empty
+ */
+void *mpmc_ring_pop(mpmc_ring_t *ring);
+
+/**
+ * returns the number of items currently in the ring; only a snapshot
+ * while other threads are pushing or popping
+ */
+int mpmc_ring_length(mpmc_ring_t *ring);
+
+/**
+ * marks `*word` as having a sleeper and returns the value to pass to
+ * `futex_wait_word()`; the caller must take one last look for work
+ * after this, since a wakeup before it is not remembered
+ * NOTE: the low bit of the word flags sleepers, the rest counts wakeups
+ */
+uint32_t futex_prepare_wait(uint32_t *word);
+
+/**
+ * sleeps until `futex_wake_waiters()` is called, unless it already
+ * was since `futex_prepare_wait()` returned `expected`
+ */
+void futex_wait_word(uint32_t *word, uint32_t expected);
+
+/**
+ * wakes every thread sleeping on `*word`; costs only an atomic load
+ * when there is none, so it can be called after every push
+ */
+void futex_wake_waiters(uint32_t *word);
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef PACK_H_
+#define PACK_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * pack file layout, all integers little-endian:
+ *
+ *   "IMGPACK1"                               magic
+ *   image data, back to back
+ *   index, one record per image:
+ *     u16 name length, name bytes, u64 offset, u64 size, u32 crc32
+ *   u64 index offset, u64 number of images, "IMGPIDX1"   trailer
+ */
+#define PACK_MAGIC          "IMGPACK1"
+#define PACK_INDEX_MAGIC    "IMGPIDX1"
+#define PACK_MAGIC_SIZE     8
+#define PACK_TRAILER_SIZE   (8 + 8 + PACK_MAGIC_SIZE)
+
+/********************* [ Helpful Typedefs        ] ************************/
+
+/**
+ * one image stored in a pack file
+ */
+typedef struct pack_entry
+{
+    char    *name;
+    uint64_t offset;   // from the start of the pack file
+    uint64_t size;
+    uint32_t crc;      // crc32 of the image bytes
+} pack_entry_t;
+
+/**
+ * a pack file being written; images are appended as they come
+ * and the index is written by `pack_close()`
+ */
+typedef struct pack_writer
+{
+    int           fd;
+    char         *path;
+    char         *temp_path;   // the pack is only renamed to `path` once complete
+    uint64_t      offset;      // where the next image goes
+    pack_entry_t *entries;
+    int           num_entries;
+    int           capacity;
+} pack_writer_t;
+
+/**
+ * returns the crc32 (IEEE 802.3) of `size` bytes at `data`
+ */
+uint32_t pack_crc32(const uint8_t *data, size_t size);
+
+/**
+ * starts a pack that will be published at `path` once closed
+ * returns 0 on success, -1 on failure
+ */
+int pack_open(pack_writer_t *pack, const char *path);
+
+/**
+ * appends an image and records it in the index
+ * returns 0 on success, -1 on failure
+ */
+int pack_append(pack_writer_t *pack, const char *name, const uint8_t *data, uint64_t size);
+
+/**
+ * flushes the images appended so far to disk
+ * returns 0 on success, -1 on failure
+ */
+int pack_sync(pack_writer_t *pack);
+
+/**
+ * writes the index and trailer, syncs the pack if `sync` is set
+ * and renames it into place
+ * returns 0 on success, -1 on failure
+ */
+int pack_close(pack_writer_t *pack, int sync);
+
+/**
+ * reads the index of the pack file open at `fd`
+ * returns the number of images, or -1 if the file is not a pack
+ * NOTE: `*entries` is allocated and must be released with `pack_free_index()`
+ */
+int pack_read_index(int fd, pack_entry_t **entries);
+
+/**
+ * releases an index returned by `pack_read_index()`
+ */
+void pack_free_index(pack_entry_t *entries, int num_entries);
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef PNG_STREAM_H_
+#define PNG_STREAM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#define PNG_STREAM_HEADER_BYTES 33   // signature and IHDR chunk, enough to tell whether an image is supported
+
+/********************* [ Helpful Typedefs        ] ************************/
+
+typedef enum png_stream_phase
+{
+    PNG_STREAM_CHUNK_HEADER,
+    PNG_STREAM_CHUNK_DATA,
+    PNG_STREAM_CHUNK_CRC,
+    PNG_STREAM_DONE,           // IEND was read after every row
+    PNG_STREAM_FAILED          // anything this decoder does not take, left to stb_image
+} png_stream_phase_t;
+
+/**
+ * an 8-bit, non-interlaced PNG decoded to one gray channel row by row as its bytes arrive,
+ * converted the way stb_image converts to one channel; its input is the whole image buffer,
+ * which is fed again each time more of it has been filled in
+ */
+typedef struct png_stream
+{
+    png_stream_phase_t phase;
+    size_t    offset;          // bytes of the image consumed
+    uint32_t  chunk_type;
+    uint32_t  chunk_left;      // bytes of the current chunk's data not yet consumed
+    int       width;
+    int       height;
+    int       color_type;
+    int       channels;        // bytes per pixel in the file
+    int       row_bytes;       // bytes of a row after its filter type byte
+    uint8_t   palette_gray[256];
+    int       palette_size;
+    z_stream  inflater;
+    bool      inflate_done;    // the zlib stream has ended
+    uint8_t  *row;             // filter type byte and the row being inflated
+    uint8_t  *prev_row;        // filter type byte and the last unfiltered row, zeros above the first
+    int       row_fill;        // bytes of `row` inflated so far
+    int       rows_done;       // rows written to `pixels`
+    uint8_t  *pixels;          // width * height gray pixels, NULL once taken
+} png_stream_t;
+
+/**
+ * the gray value stb_image gives a pixel when it converts colour to one channel
+ */
+uint8_t gray_of(int r, int g, int b);
+
+/**
+ * returns true if the first `length` bytes of an image, at least PNG_STREAM_HEADER_BYTES, start a
+ * PNG this decoder can take
+ */
+bool png_stream_supported(const uint8_t *data, size_t length);
+
+/**
+ * starts decoding the image whose header is at `data`; returns 0 on success, -1 if it is not
+ * supported or memory ran out, in which case the stream is left failed and only needs freeing
+ */
+int png_stream_init(png_stream_t *png, const uint8_t *data);
+
+/**
+ * decodes what has arrived of the image at `data` since the last call, where `length` bytes of it
+ * are now in; returns 0, or -1 once the stream has failed
+ */
+int png_stream_feed(png_stream_t *png, const uint8_t *data, size_t length);
+
+/**
+ * returns true once every row is decoded and the image has ended cleanly
+ */
+bool png_stream_complete(png_stream_t *png);
+
+/**
+ * frees the decoder, and the pixels unless they were taken
+ */
+void png_stream_free(png_stream_t *png);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdint.h>
+#include "mpmc_ring.h"
+
+/********************* [ Helpful Typedefs        ] ************************/
+
+/**
+ * work-stealing scheduler for a group of workers: every worker has
+ * its own lock-free ring of work items, and a worker whose ring is
+ * empty steals the oldest item from the others before going to sleep
+ */
+typedef struct scheduler
+{
+    mpmc_ring_t *rings;          // one per worker
+    int          num_workers;
+    unsigned     next_ring;      // round robin target for outside submissions
+    uint32_t     wake_word;      // futex word the idle workers sleep on
+} scheduler_t;
+
+/**
+ * initializes `sched` for `num_workers` workers whose rings hold at
+ * least `capacity` items each
+ * returns 0 on success, -1 on failure
+ */
+int scheduler_init(scheduler_t *sched, int num_workers, int capacity);
+
+/**
+ * releases the resources held by `sched`
+ * NOTE: items still in the rings are not freed
+ */
+void scheduler_destroy(scheduler_t *sched);
+
+/**
+ * hands `item` to worker `worker`, or spreads it round robin across
+ * the workers if `worker` is -1, and wakes a sleeping worker
+ * returns 0 on success, -1 if every ring is full
+ */
+int scheduler_submit(scheduler_t *sched, void *item, int worker);
+
+/**
+ * returns the next item for worker `worker`, taken from its own ring
+ * or stolen from another one, waiting for work if there is none
+ */
+void *scheduler_next(scheduler_t *sched, int worker);
+
+/**
+ * like `scheduler_next()`, but returns `NULL` instead of waiting; a
+ * thread that is not one of the workers passes -1 and only steals
+ */
+void *scheduler_try_next(scheduler_t *sched, int worker);
+
+/**
+ * returns the number of items waiting in the rings
+ */
+int scheduler_pending(scheduler_t *sched);
+
+#endif
@@ -1,7 +1,7 @@
 #ifndef IMAGE_SERVER_ROTATION_H_
 #define IMAGE_SERVER_ROTATION_H_
 
-#define _XOPEN_SOURCE
+#define _GNU_SOURCE
 
 #include <string.h>
 #include <stdlib.h>
@@ -21,10 +21,25 @@
 #include <limits.h>
 #include <stdint.h>
 #include "utils.h"
+#include "scheduler.h"
+#include "band_pool.h"
+#include "affinity.h"
+#include "buffer_pool.h"
+#include "png_stream.h"
+#include "uring.h"
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <endian.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <linux/openat2.h>
+#include <sys/syscall.h>
 #include <pthread.h>
-#include <semaphore.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -42,11 +57,32 @@
 #define INVALID -1                                  //Reusable int for marking things as invalid or incorrect 
 #define PACKET_SIZE 1024
 
-// Operations
-#define IMG_OP_ACK      (1 << 0)
-#define IMG_OP_NAK      (1 << 1)
-#define IMG_OP_ROTATE   (1 << 2)
-#define IMG_OP_EXIT     (1 << 3)
+// Protocol v2: a compact header, told apart from a v1 packet by its first bytes
+#define PACKET_V2_MAGIC   0x00495032  // "\0IP2"; no v1 packet starts with a zero byte (operation 0, no flags)
+#define PACKET_V2_VERSION 2
+#define PACKET_V2_SIZE    24
+#define PACKET_V2_MAX_EXT (PACKET_SIZE - PACKET_V2_SIZE)   // extension TLVs share the request header buffer
+
+// Extension TLV types
+#define PACKET_TLV_RAW_IMAGE 1      // the payload is raw pixels as a packet_raw_image_t describes, and so is the result
+
+// Operations: each is its own value, not a flag to combine with others; ACK, NAK, ROTATE and EXIT
+// keep the bit values v1 gave them, and later operations fill 3 and 5-7, then continue from 9
+typedef enum img_op
+{
+    IMG_OP_ACK         = 1,
+    IMG_OP_NAK         = 2,
+    IMG_OP_BUSY        = 3,     // server over its admission limit, size holds a retry-after hint in ms
+    IMG_OP_ROTATE      = 4,
+    IMG_OP_ROTATE_FD   = 5,     // local clients only: rotate the file passed as the first SCM_RIGHTS descriptor into the second
+    IMG_OP_SHM_ATTACH  = 6,     // local clients only: share the memfd passed with SCM_RIGHTS, split into `size` slots
+    IMG_OP_ROTATE_SHM  = 7,     // rotate the image in shared memory slot `size`, writing the result back into it
+    IMG_OP_EXIT        = 8,
+    IMG_OP_STREAM      = 9,     // images follow the packet, each behind a stream_entry_t, until an empty entry
+    IMG_OP_ROTATE_PATH = 10,    // the payload names an input and an output file, each NUL-terminated, under the -r root
+    IMG_OP_MULTIPLEX   = 11,    // v2 only: asks for a window of `size` requests in flight, answered as each finishes
+    IMG_OP_BATCH       = 12     // v2 only: the payload holds several images behind a batch_header_t, answered all at once
+} img_op_t;
 
 // Flags
 #define IMG_FLAG_ROTATE_180     (1 << 0)
@@ -54,6 +90,31 @@
 #define IMG_FLAG_ENCRYPTED      (1 << 2)
 #define IMG_FLAG_CHECKSUM       (1 << 3)
 
+// Connection I/O backends
+#define BACKEND_EPOLL   0
+#define BACKEND_URING   1
+
+// io_uring user_data tags, stored in the low bits of the connection pointer
+#define URING_OP_MASK   7
+#define URING_OP_READ   1
+#define URING_OP_WRITE  2
+#define URING_OP_ACCEPT 3
+#define URING_OP_WAKE   4
+#define URING_OP_ACCEPT_LOCAL 5
+
+#define DISCARD_BUFFER_SIZE (64 * 1024)
+#define ZEROCOPY_MIN_BYTES (16 * 1024)  // smaller images are cheaper to copy than to pin for MSG_ZEROCOPY / IORING_OP_SEND_ZC
+
+#define LOCAL_SOCKET_PATH "/tmp/image-processor.sock"
+#define MAX_PASSED_FDS 2
+#define SHM_SLOT_DATA_OFFSET 64     // image bytes start after the slot header, on their own cache line
+#define STREAM_WINDOW 16            // stream images received but not yet sent back before the server stops reading
+#define MULTIPLEX_WINDOW 64         // most requests one multiplexed connection may have in the server at once
+#define EARLY_DECODE_MIN_BYTES (256 * 1024) // smaller images are decoded only once they are all in
+#define EARLY_DECODE_CHUNK (128 * 1024)     // bytes read at a time of an image that is decoded as it arrives
+#define MAX_BATCH_ITEMS 256         // most images one IMG_OP_BATCH may carry
+#define STAGE_PARKED 1              // a stage routine's job waits for more of its image and is submitted again
+
 /********************* [ Helpful Typedefs        ] ************************/
 
 typedef struct packet
@@ -64,25 +125,287 @@ typedef struct packet
     unsigned char checksum[SHA256_BLOCK_SIZE];
 } packet_t;
 
-typedef struct processing_args
+// v2 request and response header, in network byte order; `ext_length` bytes of extension TLVs
+// follow it, then the payload
+typedef struct packet_v2
+{
+    uint32_t magic;        // PACKET_V2_MAGIC
+    uint8_t  version;      // PACKET_V2_VERSION
+    uint8_t  operation;
+    uint8_t  flags;
+    uint8_t  reserved;
+    uint32_t request_id;   // chosen by the client, echoed in the response
+    uint32_t ext_length;
+    uint64_t size;         // payload length, or the operation's argument as in v1
+} packet_v2_t;
+
+// one extension of a v2 header; types the server does not know are skipped
+typedef struct packet_tlv
+{
+    uint16_t type;
+    uint16_t length;       // bytes of value after this
+} packet_tlv_t;
+
+// value of a PACKET_TLV_RAW_IMAGE extension, in network byte order on the wire
+typedef struct packet_raw_image
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;     // 1 gray, 2 gray and alpha, 3 RGB or 4 RGBA, 8 bits each; results are always gray
+    uint32_t stride;       // bytes from the start of one row to the next
+} packet_raw_image_t;
+
+struct connection;
+struct shard;
+
+// start of every slot in the memory a local client shares with IMG_OP_SHM_ATTACH
+typedef struct shm_slot_header
+{
+    uint32_t in_size;    // written by the client before IMG_OP_ROTATE_SHM
+    uint32_t out_size;   // written by the server before its ACK
+} shm_slot_header_t;
+
+// precedes every image of an IMG_OP_STREAM in both directions, in network byte order;
+// an entry with no name ends the stream
+typedef struct stream_entry
+{
+    uint32_t name_length;   // bytes of file name that follow this header
+    uint32_t size;          // bytes of image that follow the name
+    uint32_t status;        // results only: IMG_OP_ACK, or IMG_OP_NAK with no image
+} stream_entry_t;
+
+// starts an IMG_OP_BATCH payload and its response in network byte order, followed by `count`
+// batch_item_t and then the images they point at
+typedef struct batch_header
+{
+    uint32_t count;
+} batch_header_t;
+
+// one image of a batch, in network byte order
+typedef struct batch_item
+{
+    uint32_t status;        // results only: IMG_OP_ACK, or IMG_OP_NAK with no image
+    uint32_t offset;        // where the image starts, from the start of the payload
+    uint32_t size;
+} batch_item_t;
+
+// the pixels of one image of a batch job, NULL if it could not be decoded
+typedef struct batch_image
 {
-    int sockfd;
-    int worker_num;
-    // char *file_name;
-} processing_args_t;
+    uint8_t *pixels;
+    int      width;
+    int      height;
+} batch_image_t;
+
+// a single image handed from the event loop to the worker pool
+typedef struct job
+{
+    struct connection *conn;    // connection the result is sent back on
+    int                angle;
+    uint8_t           *in_data;  // encoded image received from the client, NULL if it came as in_fd
+    int                in_size;
+    int                in_fd;    // file passed by a local client to read the image from, -1 otherwise
+    int                out_fd;   // file passed by a local client to write the result to, -1 otherwise
+    int                out_dir_fd; // IMG_OP_ROTATE_PATH: directory of the output, whose temp file is renamed over `name` on success, -1 otherwise
+    shm_slot_header_t *slot;     // shared memory slot holding in_data and out_data, NULL otherwise
+    uint8_t           *out_data; // encoded image to send back, filled by a worker
+    int                out_size;
+    int                out_capacity; // bytes allocated for out_data, -1 if growing it failed
+    int                result_fd; // -d with epoll: unlinked temp file holding the result, sent with sendfile(), -1 otherwise
+    long               zc_seq;   // id of the last MSG_ZEROCOPY send that read out_data, -1 if none
+    uint8_t           *pixels;   // decoded pixels, replaced by the flipped ones after the transform
+    int                width;
+    int                height;
+    int                status;   // 0 on success, -1 if the image could not be processed
+    double             job_ms;   // time the workers spent on the image, over all stages
+    struct job        *next;     // link in the event loop's list of finished jobs
+    char              *name;     // stream images: the name the result goes back under; path requests: the output's file name
+    bool               finished; // stream images only: back from the workers
+    struct job        *stream_next; // next image of the same stream, in arrival order
+    uint32_t           request_id; // multiplexed requests only: the id the result goes back under
+    bool               path;     // IMG_OP_ROTATE_PATH: a failure is answered without closing the connection
+    bool               raw;      // in_data holds raw pixels and the result goes back as raw gray pixels
+    int                raw_channels;
+    int                raw_stride;
+    bool               batch;    // in_data holds an IMG_OP_BATCH payload, and out_data gets the same layout for the results
+    int                batch_count;
+    batch_image_t     *batch_images; // one for each image of the batch
+    // images decoded while they are still arriving only
+    bool               early_checked; // the event loop has seen enough of the image to decide
+    bool               early_decode; // handed to the decode stage before all of it was in
+    int                received;  // bytes of in_data in so far, published by the event loop
+    int                feed_kicks; // times the event loop woke the decoder since it last ran dry, 0 while it is parked
+    bool               input_failed; // the upload broke off, the decoder gives up
+    png_stream_t      *png;       // incremental decoder, NULL once done with
+    int                rows_flipped; // rows of the transform already written to pixels
+    bool               transformed; // flipped while decoding, the transform stage has nothing to do
+} job_t;
+
+typedef struct event_loop
+{
+    struct shard      *shard;          // shard whose worker pool runs this loop's jobs
+    int                backend;        // BACKEND_EPOLL or BACKEND_URING
+    int                epoll_fd;
+    int                listen_fd;
+    int                local_fd;       // AF_UNIX listener for local clients, -1 if this loop has none
+    int                wake_fd;        // eventfd written by workers when a job finishes
+    uint64_t           wake_count;
+    pthread_mutex_t    done_lock;
+    job_t             *done_jobs;      // finished jobs waiting to be sent back
+    struct connection *waiting_streams; // streams holding an image header until admission lets it in
+    char               discard_buffer[DISCARD_BUFFER_SIZE]; // sink for images that were refused
+    buffer_pool_t      buffers;        // jobs, received images, names and encoded results, recycled across requests
+
+    // io_uring backend only
+    uring_t            ring;
+    struct connection *conn_slab;      // registered as fixed buffer 0
+    int               *free_slots;
+    int                num_free_slots;
+    bool               fixed_buffers;  // false if buffer registration failed
+    bool               send_zc;        // large images go out with IORING_OP_SEND_ZC
+} event_loop_t;
+
+typedef enum conn_state
+{
+    CONN_READING_HEADER,
+    CONN_READING_PAYLOAD,
+    CONN_DISCARDING_PAYLOAD,   // skipping the image of a request refused by admission control
+    CONN_WAITING_COMPUTE,
+    CONN_WRITING_RESPONSE,
+    CONN_STREAMING,            // IMG_OP_STREAM or IMG_OP_MULTIPLEX: receiving images and sending results back at the same time
+    CONN_CLOSING               // client left while a worker still holds its job
+} conn_state_t;
+
+typedef enum stream_input
+{
+    STREAM_ENTRY_HEADER,
+    STREAM_ENTRY_NAME,
+    STREAM_ENTRY_PAYLOAD,
+    STREAM_INPUT_DONE          // the empty entry, or IMG_OP_EXIT of a multiplexed connection, arrived
+} stream_input_t;
+
+// per-client state kept by the event loop between socket events
+typedef struct connection
+{
+    int           sockfd;
+    event_loop_t *loop;
+    conn_state_t  state;
+    char          header[PACKET_SIZE];   // request packet being received
+    int           header_bytes;
+    int           version;               // protocol of the current request, answered in kind
+    uint32_t      request_id;            // v2 only, echoed in the response
+    bool          raw_request;           // the request carried a PACKET_TLV_RAW_IMAGE
+    packet_raw_image_t raw_image;        // its value, in host byte order
+    job_t        *job;                   // image being received, processed or sent
+    int           payload_bytes;
+    int           discard_bytes;         // image bytes of a refused request still to skip
+    bool          path_request;          // the payload being received holds IMG_OP_ROTATE_PATH paths
+    char          response[PACKET_SIZE]; // ACK/NAK packet, or stream entry header and name, being sent
+    int           response_size;         // bytes of `response` in use
+    int           response_bytes;        // counts the response payload too
+    bool          close_after_write;
+    bool          local;                 // accepted on the AF_UNIX listener
+    int           passed_fds[MAX_PASSED_FDS]; // descriptors attached to the request packet
+    int           num_passed_fds;
+    struct msghdr header_msg;            // recvmsg() arguments for a local client's request packet
+    struct iovec  header_iov;
+    char          header_control[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+    uint8_t      *shm_base;              // image slots shared with IMG_OP_SHM_ATTACH, NULL if none
+    size_t        shm_size;
+    int           shm_slot_size;
+    int           shm_num_slots;
+    bool          zerocopy;              // SO_ZEROCOPY is on, large images go out with MSG_ZEROCOPY
+    uint32_t      zc_sent;               // MSG_ZEROCOPY sends issued, the next one gets this id
+    uint32_t      zc_done;               // sends with lower ids the kernel has finished reading
+    job_t        *zc_jobs;               // answered jobs whose images a zero-copy send may still read
+    int           jobs_in_flight;        // images a worker still holds
+    // IMG_OP_STREAM and IMG_OP_MULTIPLEX only
+    bool          multiplexed;           // entries are v2 requests in `header`, answered as they finish
+    int           stream_window;         // images received but not yet sent back before reading stops
+    int           stream_angle;
+    stream_input_t stream_input;
+    stream_entry_t entry;                // header of the image being received
+    int           entry_bytes;           // received of the entry header, then of the name
+    job_t        *entry_job;             // image being received
+    job_t        *stream_head;           // images handed to the workers and not yet sent back, oldest first
+    job_t        *stream_tail;
+    int           stream_jobs;           // images received and not yet sent back
+    bool          stream_end_sent;       // the empty entry is (being) sent
+    bool          stream_waiting;        // on the loop's waiting_streams list
+    struct connection *next_waiting;
+    bool          write_blocked;         // epoll: waiting for EPOLLOUT
+    bool          read_pending;          // io_uring: a receive is queued
+    int           write_ops;             // io_uring: sends of the result being sent
+    int           slot;                  // index in the io_uring slab, -1 if malloc'd
+    int           pending_ops;           // io_uring operations not yet completed
+    bool          io_error;
+} connection_t;
+
+// one flip of an image, shared by the bands it is split into
+typedef struct flip_args
+{
+    const uint8_t *src;
+    uint8_t       *dst;
+    int            width;    // rows, as laid out by linear_to_image()
+    int            height;   // pixels per row
+    int            angle;
+} flip_args_t;
 
-/// @brief 
 typedef struct worker_thread
 {
-    pthread_t         thread;
-    processing_args_t pargs;
-    bool              available;
+    pthread_t     thread;
+    int           worker_num;   // unique across shards, also names the worker's temp directory
+    int           index;        // the worker's deque in its stage's scheduler
+    struct stage *stage;
 } worker_thread_t;
 
-// serialize packet
-char *serialize_packet(packet_t *packet);
+typedef enum stage_kind
+{
+    STAGE_DECODE,
+    STAGE_TRANSFORM,
+    STAGE_ENCODE,
+    NUM_STAGES
+} stage_kind_t;
+
+// one step of the image pipeline, with its own work-stealing worker pool
+typedef struct stage
+{
+    const char      *name;
+    int            (*run)(job_t *job, int worker_num);   // returns -1 if the image failed
+    scheduler_t      sched;       // images waiting for this stage, spread over the workers' deques
+    worker_thread_t *workers;
+    int              num_workers;
+    long             processed;   // images this stage has finished, updated atomically
+    struct stage    *next;        // NULL for the last stage
+} stage_t;
+
+// limits on the work a shard holds at once; only touched by the shard's event loop
+typedef struct admission
+{
+    int    max_jobs;            // images admitted but not yet answered
+    long   max_bytes;           // bytes of image data held by those images
+    int    jobs;
+    long   bytes;
+    double avg_job_ms;          // moving average of worker time per image
+} admission_t;
+
+// an accept loop on its own SO_REUSEPORT socket, with its own pipeline of worker pools
+typedef struct shard
+{
+    int              shard_num;
+    admission_t      admission;
+    pthread_t        thread;
+    event_loop_t     loop;        // receives requests and sends the responses
+    stage_t          stages[NUM_STAGES];
+    int              num_workers; // over all stages
+    int              node;        // index of the NUMA node the shard's threads stay on, -1 if unplaced
+    band_pool_t     *band_pool;   // splits this shard's large images, on the same node
+} shard_t;
+
+// serialize packet into the PACKET_SIZE bytes at `serialized_data`
+void serialize_packet(packet_t *packet, char *serialized_data);
 
-// deserialize data
-packet_t *deserialize_data(char *serialized_data);
+// deserialize data into `packet`
+void deserialize_data(char *serialized_data, packet_t *packet);
 
 #endif
@@ -0,0 +1,87 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/********************* [ Helpful Typedefs        ] ************************/
+
+/**
+ * a minimal io_uring instance driven directly through the
+ * io_uring_setup / io_uring_enter / io_uring_register syscalls
+ */
+typedef struct uring
+{
+    int                  ring_fd;
+
+    // submission queue
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned             sq_entries;
+    unsigned             to_submit;   // sqes filled in since the last submit
+
+    // completion queue
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void                *ring_ptr;
+    size_t               ring_size;
+    size_t               sqes_size;
+} uring_t;
+
+/**
+ * creates a ring with room for `entries` submissions
+ * returns 0 on success, -1 on failure
+ */
+int uring_init(uring_t *ring, unsigned entries);
+
+/**
+ * unmaps and closes the ring
+ */
+void uring_destroy(uring_t *ring);
+
+/**
+ * registers `nr` buffers with the kernel so that fixed reads and
+ * writes can address them by index
+ * returns 0 on success, -1 on failure
+ */
+int uring_register_buffers(uring_t *ring, struct iovec *iovs, unsigned nr);
+
+/**
+ * asks the kernel whether it knows the `IORING_OP_*` opcode `op`
+ * returns 1 if it does, 0 if not or if the probe failed
+ */
+int uring_op_supported(uring_t *ring, int op);
+
+/**
+ * returns a zeroed submission entry to fill in, or `NULL`
+ * if the submission queue is full
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+/**
+ * submits every pending entry and waits until at least `wait_nr`
+ * completions are available
+ * returns the number of entries submitted, or -1 on failure
+ */
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr);
+
+/**
+ * returns the oldest unconsumed completion, or `NULL` if there is none
+ * NOTE: the entry must be released with `uring_cqe_seen()`
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+
+/**
+ * releases the completion returned by `uring_peek_cqe()`
+ */
+void uring_cqe_seen(uring_t *ring);
+
+#endif
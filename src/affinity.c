@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <stdbool.h>
+#include "affinity.h"
+
+#define SYSFS_NODE_DIR "/sys/devices/system/node"
+
+int parse_cpu_list(const char *text, cpu_list_t *list)
+{
+    list->cpus = NULL;
+    list->num_cpus = 0;
+
+    bool valid = true;
+    const char *pos = text;
+    while (valid && *pos != '\0' && *pos != '\n')
+    {
+        char *end;
+        long first = strtol(pos, &end, 10);
+        long last  = first;
+        valid = (end != pos && first >= 0);
+
+        if (valid && *end == '-')
+        {
+            pos = end + 1;
+            last = strtol(pos, &end, 10);
+            valid = (end != pos && last >= first);
+        }
+        if (!valid)
+            break;
+
+        list->cpus = realloc(list->cpus, sizeof(int) * (list->num_cpus + last - first + 1));
+        for (long cpu = first; cpu <= last; cpu++)
+            list->cpus[list->num_cpus++] = cpu;
+
+        if (*end == ',')
+            end++;
+        else if (*end != '\0' && *end != '\n')
+            valid = false;
+        pos = end;
+    }
+
+    if (!valid || list->num_cpus == 0)
+    {
+        free(list->cpus);
+        list->cpus = NULL;
+        list->num_cpus = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+int read_cpu_list_file(const char *path, cpu_list_t *list)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    char line[1024];
+    int result = -1;
+    if (fgets(line, sizeof(line), file) != NULL)
+        result = parse_cpu_list(line, list);
+
+    fclose(file);
+    return result;
+}
+
+int numa_topology(cpu_list_t *nodes, cpu_list_t **node_cpus)
+{
+    if (read_cpu_list_file(SYSFS_NODE_DIR "/online", nodes) == -1)
+        return 0;
+
+    *node_cpus = malloc(sizeof(cpu_list_t) * nodes->num_cpus);
+    for (int i = 0; i < nodes->num_cpus; i++)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), SYSFS_NODE_DIR "/node%d/cpulist", nodes->cpus[i]);
+
+        // memory-only nodes have an empty cpulist; leave their threads unbound
+        if (read_cpu_list_file(path, &(*node_cpus)[i]) == -1)
+        {
+            (*node_cpus)[i].cpus = NULL;
+            (*node_cpus)[i].num_cpus = 0;
+        }
+    }
+
+    return nodes->num_cpus;
+}
+
+int bind_thread(pthread_t thread, const cpu_list_t *list)
+{
+    if (list->num_cpus == 0)
+        return 0;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < list->num_cpus; i++)
+        CPU_SET(list->cpus[i], &set);
+
+    if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0)
+        return -1;
+    return 0;
+}
+
+int pin_thread(pthread_t thread, const cpu_list_t *list, int slot)
+{
+    if (list->num_cpus == 0)
+        return 0;
+
+    cpu_list_t single = { &list->cpus[slot % list->num_cpus], 1 };
+    return bind_thread(thread, &single);
+}
@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "band_pool.h"
+
+// the bands of one band_pool_run() call, and how many are still running
+typedef struct band_group
+{
+    band_fn_t       fn;
+    void           *arg;
+    int             remaining;
+    pthread_mutex_t lock;
+    pthread_cond_t  done;
+} band_group_t;
+
+typedef struct band
+{
+    band_group_t *group;
+    int           first_row;
+    int           last_row;
+} band_t;
+
+void finish_band(band_group_t *group)
+{
+    pthread_mutex_lock(&group->lock);
+    if (--group->remaining == 0)
+        pthread_cond_signal(&group->done);
+    pthread_mutex_unlock(&group->lock);
+}
+
+void run_band(band_t *band)
+{
+    band_group_t *group = band->group;
+    group->fn(group->arg, band->first_row, band->last_row);
+    finish_band(group);
+}
+
+void *band_routine(void *args)
+{
+    band_helper_t *helper = (band_helper_t *)args;
+
+    while (true)
+        run_band(scheduler_next(&helper->pool->sched, helper->index));
+
+    return NULL;
+}
+
+int band_pool_init(band_pool_t *pool, int num_threads)
+{
+    pool->num_threads = num_threads;
+    pool->helpers = NULL;
+    if (num_threads == 0)
+        return 0;
+
+    // several images can be split at once; a band that finds every deque full runs on the caller
+    if (scheduler_init(&pool->sched, num_threads, 16) == -1)
+        return -1;
+
+    pool->helpers = malloc(sizeof(band_helper_t) * num_threads);
+    for (int i = 0; i < num_threads; i++)
+    {
+        pool->helpers[i].index = i;
+        pool->helpers[i].pool  = pool;
+        if (pthread_create(&pool->helpers[i].thread, NULL, band_routine, &pool->helpers[i]) != 0)
+        {
+            fprintf(stderr, "ERROR: Thread creation error\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void band_pool_run(band_pool_t *pool, band_fn_t fn, void *arg, int rows, int num_bands)
+{
+    if (num_bands > pool->num_threads + 1)
+        num_bands = pool->num_threads + 1;
+    if (num_bands > rows)
+        num_bands = rows;
+    if (num_bands <= 1)
+    {
+        fn(arg, 0, rows);
+        return;
+    }
+
+    band_group_t group;
+    group.fn        = fn;
+    group.arg       = arg;
+    group.remaining = num_bands;
+    pthread_mutex_init(&group.lock, NULL);
+    pthread_cond_init(&group.done, NULL);
+
+    // bands live on this stack frame, which outlives them since we wait below
+    band_t bands[num_bands];
+    for (int i = 0; i < num_bands; i++)
+    {
+        bands[i].group     = &group;
+        bands[i].first_row = (long)rows * i / num_bands;
+        bands[i].last_row  = (long)rows * (i + 1) / num_bands;
+    }
+
+    for (int i = 1; i < num_bands; i++)
+    {
+        if (scheduler_submit(&pool->sched, &bands[i], -1) == -1)
+            run_band(&bands[i]);
+    }
+    run_band(&bands[0]);
+
+    // help with whatever bands are still queued, ours or another image's, before sleeping
+    band_t *band;
+    while (__atomic_load_n(&group.remaining, __ATOMIC_ACQUIRE) > 0 &&
+           (band = scheduler_try_next(&pool->sched, -1)) != NULL)
+        run_band(band);
+
+    pthread_mutex_lock(&group.lock);
+    while (group.remaining > 0)
+        pthread_cond_wait(&group.done, &group.lock);
+    pthread_mutex_unlock(&group.lock);
+
+    pthread_cond_destroy(&group.done);
+    pthread_mutex_destroy(&group.lock);
+}
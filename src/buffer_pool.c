@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <string.h>
+#include "buffer_pool.h"
+
+// only the owning thread writes the counters, so a plain store is enough for readers elsewhere
+#define COUNT(counter) __atomic_store_n(&(counter), (counter) + 1, __ATOMIC_RELAXED)
+
+void buffer_pool_init(buffer_pool_t *pool)
+{
+    memset(pool, 0, sizeof(buffer_pool_t));
+}
+
+// the smallest class that holds `size`, past BUFFER_POOL_MAX_SHIFT if none does
+int size_class_shift(size_t size)
+{
+    int shift = BUFFER_POOL_MIN_SHIFT;
+    while (shift <= BUFFER_POOL_MAX_SHIFT && ((size_t)1 << shift) < size)
+        shift++;
+    return shift;
+}
+
+void *buffer_pool_get(buffer_pool_t *pool, size_t size, size_t *capacity)
+{
+    COUNT(pool->gets);
+
+    int shift = size_class_shift(size);
+
+    if (shift > BUFFER_POOL_MAX_SHIFT)
+    {
+        COUNT(pool->allocated);
+        if (capacity != NULL)
+            *capacity = size;
+        return malloc(size > 0 ? size : 1);
+    }
+
+    if (capacity != NULL)
+        *capacity = (size_t)1 << shift;
+
+    int class = shift - BUFFER_POOL_MIN_SHIFT;
+    pool_buffer_t *buffer = pool->free_lists[class];
+    if (buffer != NULL)
+    {
+        COUNT(pool->reused);
+        pool->free_lists[class] = buffer->next;
+        pool->num_free[class]--;
+        return buffer;
+    }
+
+    COUNT(pool->allocated);
+    return malloc((size_t)1 << shift);
+}
+
+void buffer_pool_put(buffer_pool_t *pool, void *buffer, size_t size)
+{
+    if (buffer == NULL)
+        return;
+
+    // the class it was handed out from, or a smaller one if `size` is smaller
+    int shift = size_class_shift(size);
+    int class = shift - BUFFER_POOL_MIN_SHIFT;
+    if (size == 0 || shift > BUFFER_POOL_MAX_SHIFT || pool->num_free[class] >= BUFFER_POOL_KEEP ||
+        ((long)pool->num_free[class] + 1) << shift > BUFFER_POOL_KEEP_BYTES)
+    {
+        COUNT(pool->released);
+        free(buffer);
+        return;
+    }
+
+    pool_buffer_t *freed = buffer;
+    freed->next = pool->free_lists[class];
+    pool->free_lists[class] = freed;
+    pool->num_free[class]++;
+}
+
+void buffer_pool_destroy(buffer_pool_t *pool)
+{
+    for (int i = 0; i < BUFFER_POOL_NUM_CLASSES; i++)
+    {
+        while (pool->free_lists[i] != NULL)
+        {
+            pool_buffer_t *next = pool->free_lists[i]->next;
+            free(pool->free_lists[i]);
+            pool->free_lists[i] = next;
+        }
+        pool->num_free[i] = 0;
+    }
+}
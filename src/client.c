@@ -4,6 +4,60 @@
 #define BUFFER_SIZE 1024
 
 request_queue_t *requests;
+bool pass_fds;   // -f: hand the server our files instead of sending and receiving the bytes
+int protocol_version = PACKET_V2_VERSION;   // -1 talks v1 to servers that predate v2
+uint32_t next_request_id;
+bool share_paths;   // -p: name our files to a server that sees the same filesystem
+bool raw_pixels;    // -R: send the pixels of PGM and PPM files as they are and save the raw results as PGM
+bool batch_images = true;   // small images go out together in IMG_OP_BATCH requests, -B sends each on its own
+
+// -m: image slots shared with the server, used round robin
+uint8_t *shm_base;
+int next_slot;
+
+// results waiting for the writer thread, which publishes them while the next images are in flight
+job_queue_t output_queue;
+bool sync_outputs;    // -F: fsync every batch of results before publishing it
+bool output_failed;   // set by the writer if a result could not be saved
+bool pack_outputs;    // -P: append results to one pack file in the output directory
+pack_writer_t output_pack;
+
+// opens the request's input image and stores its size; returns the descriptor, or -1 on failure
+int open_input_file(char *input_dir, request_t *request, int *size)
+{
+    const int IMG_PATH_LENGTH = strlen(input_dir) + strlen(request->file_name) + 2;
+    char img_location[IMG_PATH_LENGTH];
+    sprintf(img_location, "%s/%s", input_dir, request->file_name);
+
+    int img_fd = open(img_location, O_RDONLY);
+    struct stat img_stat;
+    if (img_fd == -1 || fstat(img_fd, &img_stat) == -1)
+    {
+        fprintf(stderr, "ERROR: Could not open file\n");
+        if (img_fd != -1)
+            close(img_fd);
+        return -1;
+    }
+
+    *size = img_stat.st_size;
+    return img_fd;
+}
+
+// reads exactly `size` bytes; returns 0 on success, -1 if the connection failed or closed
+int recv_fully(int socket, void *dest, int size)
+{
+    int received = 0;
+    while (received < size)
+    {
+        ssize_t new_bytes = recv(socket, (char *)dest + received, size - received, MSG_WAITALL);
+        if (new_bytes == -1 && errno == EINTR)
+            continue;
+        if (new_bytes <= 0)
+            return -1;
+        received += new_bytes;
+    }
+    return 0;
+}
 
 void init_request_queue()
 {
@@ -42,6 +96,7 @@ void add_request(request_queue_t *queue, char *file_name, int angle)
     request_t *req = malloc(sizeof(request_t));
     req->file_name = file_name;
     req->angle     = angle;
+    req->slot      = -1;
 
     // if the queue is empty, add the request to the current node instead of making a new one
     if (request_queue_empty())
@@ -84,26 +139,93 @@ request_t *get_request()
     return req;
 }
 
-char *serialize_packet(packet_t *packet)
+int serialize_packet(packet_t *packet, char *serialized_data)
 {
+    if (protocol_version == PACKET_V2_VERSION)
+    {
+        packet_v2_t *header = (packet_v2_t *)serialized_data;
+        memset(header, 0, sizeof(packet_v2_t));
+        header->magic      = htonl(PACKET_V2_MAGIC);
+        header->version    = PACKET_V2_VERSION;
+        header->operation  = packet->operation;
+        header->flags      = packet->flags;
+        header->request_id = htonl(next_request_id++);
+        header->size       = htobe64((uint64_t)packet->size);
+        return PACKET_V2_SIZE;
+    }
+
+    // v1 only has 16 bits of size on the wire
     packet->size = htons(packet->size);
 
-    char *serialized_data = malloc(sizeof(char) * PACKET_SIZE);
     memset(serialized_data, '\0', PACKET_SIZE);
-    memcpy(serialized_data, packet, PACKET_SIZE);
-
-    return serialized_data;
+    memcpy(serialized_data, packet, sizeof(packet_t));
+    return PACKET_SIZE;
 }
 
-packet_t *deserialize_data(char *serialized_data)
+void deserialize_data(char *serialized_data, packet_t *packet)
 {
-    packet_t *packet = malloc(sizeof(char) * PACKET_SIZE); // (packet_t *)malloc(sizeof(packet_t));
-    memset(packet, 0, PACKET_SIZE);
-    memcpy(packet, serialized_data, PACKET_SIZE);
+    memcpy(packet, serialized_data, sizeof(packet_t));
 
     packet->size = ntohs(packet->size);
+}
+
+// receives the server's response header, in the protocol the request went out in, and stores
+// the request id it echoes in `*request_id` unless that is NULL (v1 has none, so it is 0), and the
+// layout of a raw result in `*raw` unless that is NULL (its width is 0 if the result is not raw)
+// returns 0 on success, -1 on failure
+int receive_packet(int socket, packet_t *packet, uint32_t *request_id, packet_raw_image_t *raw)
+{
+    if (request_id != NULL)
+        *request_id = 0;
+    if (raw != NULL)
+        memset(raw, 0, sizeof(packet_raw_image_t));
+
+    char recv_data[PACKET_SIZE];
+    if (protocol_version != PACKET_V2_VERSION)
+    {
+        if (recv_fully(socket, recv_data, PACKET_SIZE) == -1)
+            return -1;
+        deserialize_data(recv_data, packet);
+        return 0;
+    }
 
-    return packet;
+    packet_v2_t header;
+    if (recv_fully(socket, &header, sizeof(packet_v2_t)) == -1 || ntohl(header.magic) != PACKET_V2_MAGIC)
+        return -1;
+
+    uint32_t ext_length = ntohl(header.ext_length);
+    uint64_t size = be64toh(header.size);
+    if (ext_length > PACKET_V2_MAX_EXT || size > INT_MAX || recv_fully(socket, recv_data, ext_length) == -1)
+        return -1;
+
+    // extensions other than a raw result's layout are skipped
+    uint32_t ext = 0;
+    while (ext + sizeof(packet_tlv_t) <= ext_length)
+    {
+        packet_tlv_t tlv;
+        memcpy(&tlv, recv_data + ext, sizeof(packet_tlv_t));
+        ext += sizeof(packet_tlv_t);
+        if (ntohs(tlv.length) > ext_length - ext)
+            return -1;
+
+        if (raw != NULL && ntohs(tlv.type) == PACKET_TLV_RAW_IMAGE && ntohs(tlv.length) == sizeof(packet_raw_image_t))
+        {
+            memcpy(raw, recv_data + ext, sizeof(packet_raw_image_t));
+            raw->width    = ntohl(raw->width);
+            raw->height   = ntohl(raw->height);
+            raw->channels = ntohl(raw->channels);
+            raw->stride   = ntohl(raw->stride);
+        }
+        ext += ntohs(tlv.length);
+    }
+
+    memset(packet, 0, sizeof(packet_t));
+    packet->operation = header.operation;
+    packet->flags     = header.flags;
+    packet->size      = size;
+    if (request_id != NULL)
+        *request_id = ntohl(header.request_id);
+    return 0;
 }
 
 int terminate_connection(int socket)
@@ -113,10 +235,11 @@ int terminate_connection(int socket)
     packet.flags = 0;
     packet.size = 0;
 
-    char *serialized_data = serialize_packet(&packet);
+    char serialized_data[PACKET_SIZE];
+    int header_size = serialize_packet(&packet, serialized_data);
 
     // Send the file data
-    if (send(socket, serialized_data, PACKET_SIZE, 0) == -1)
+    if (send(socket, serialized_data, header_size, 0) == -1)
     {
         fprintf(stderr, "Error: Could not send request data");
         return -1;
@@ -125,23 +248,323 @@ int terminate_connection(int socket)
     return 0;
 }
 
-int send_file(int socket, char *input_dir, request_t *request)
+// sends `packet` with `num_fds` descriptors attached as SCM_RIGHTS
+int send_packet_with_fds(int socket, packet_t *packet, int *fds, int num_fds)
 {
-    const int IMG_PATH_LENGTH = strlen(input_dir) + strlen(request->file_name) + 1;
-    char img_location[IMG_PATH_LENGTH];
-    sprintf(img_location, "%s/%s", input_dir, request->file_name);
+    char serialized_data[PACKET_SIZE];
+    int header_size = serialize_packet(packet, serialized_data);
 
-    // Open the file
-    FILE *img;
-    if((img = fopen(img_location, "r")) == NULL)
+    struct iovec iov;
+    iov.iov_base = serialized_data;
+    iov.iov_len  = header_size;
+
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * num_fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+
+    int result = 0;
+    if (sendmsg(socket, &msg, 0) != header_size)
+    {
+        fprintf(stderr, "Error: Could not send request data");
+        result = -1;
+    }
+
+    return result;
+}
+
+// sends an IMG_OP_ROTATE_FD request carrying the input file and the truncated output file as descriptors
+int send_file_descriptors(int socket, char *input_dir, char *output_dir, request_t *request)
+{
+    const int IN_PATH_LENGTH = strlen(input_dir) + strlen(request->file_name) + 2;
+    char in_location[IN_PATH_LENGTH];
+    sprintf(in_location, "%s/%s", input_dir, request->file_name);
+
+    const int OUT_PATH_LENGTH = strlen(output_dir) + strlen(request->file_name) + 2;
+    char out_location[OUT_PATH_LENGTH];
+    sprintf(out_location, "%s/%s", output_dir, request->file_name);
+
+    int fds[2];
+    if ((fds[0] = open(in_location, O_RDONLY)) == -1)
     {
         fprintf(stderr, "ERROR: Could not open file\n");
         return -1;
     }
+    if ((fds[1] = open(out_location, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+    {
+        fprintf(stderr, "ERROR: Cannot open file location %s\n", out_location);
+        close(fds[0]);
+        return -1;
+    }
+
+    packet_t packet;
+    packet.operation = IMG_OP_ROTATE_FD;
+    if (request->angle == 180)
+        packet.flags = IMG_FLAG_ROTATE_180;
+    else if (request->angle == 270)
+        packet.flags = IMG_FLAG_ROTATE_270;
+    packet.size = 0;
+
+    int result = send_packet_with_fds(socket, &packet, fds, 2);
+
+    // the server holds its own copies of the descriptors now
+    close(fds[0]);
+    close(fds[1]);
+    return result;
+}
+
+// -p: sends the absolute paths of the input image and its output, which the server opens itself
+// returns 0 on success, -1 on failure
+int send_file_paths(int socket, char *input_dir, char *output_dir, request_t *request)
+{
+    const int IN_PATH_LENGTH = strlen(input_dir) + strlen(request->file_name) + 2;
+    const int OUT_PATH_LENGTH = strlen(output_dir) + strlen(request->file_name) + 2;
+    char paths[IN_PATH_LENGTH + OUT_PATH_LENGTH];
+    sprintf(paths, "%s/%s", input_dir, request->file_name);
+    sprintf(paths + IN_PATH_LENGTH, "%s/%s", output_dir, request->file_name);
+
+    packet_t packet;
+    packet.operation = IMG_OP_ROTATE_PATH;
+    if (request->angle == 180)
+        packet.flags = IMG_FLAG_ROTATE_180;
+    else if (request->angle == 270)
+        packet.flags = IMG_FLAG_ROTATE_270;
+    packet.size = IN_PATH_LENGTH + OUT_PATH_LENGTH;
+
+    // the request packet and both paths go out in one segment
+    char request_data[PACKET_SIZE + sizeof(paths)];
+    int header_size = serialize_packet(&packet, request_data);
+    memcpy(request_data + header_size, paths, sizeof(paths));
+
+    int request_size = header_size + sizeof(paths);
+    if (send(socket, request_data, request_size, 0) != request_size)
+    {
+        fprintf(stderr, "Error: Could not send request data");
+        return -1;
+    }
+    return 0;
+}
+
+// creates the memory shared with the server and splits it into SHM_NUM_SLOTS slots
+int attach_shared_memory(int socket)
+{
+    int shm_fd = memfd_create("image-client", MFD_CLOEXEC);
+    if (shm_fd == -1 || ftruncate(shm_fd, (off_t)SHM_NUM_SLOTS * SHM_SLOT_SIZE) == -1)
+    {
+        fprintf(stderr, "ERROR: Could not create shared memory\n");
+        return -1;
+    }
+
+    shm_base = mmap(NULL, (size_t)SHM_NUM_SLOTS * SHM_SLOT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (shm_base == MAP_FAILED)
+    {
+        fprintf(stderr, "ERROR: Could not map shared memory\n");
+        close(shm_fd);
+        return -1;
+    }
+
+    packet_t packet;
+    packet.operation = IMG_OP_SHM_ATTACH;
+    packet.flags = 0;
+    packet.size = SHM_NUM_SLOTS;
+
+    int result = send_packet_with_fds(socket, &packet, &shm_fd, 1);
+    close(shm_fd);
+    if (result == -1)
+        return -1;
+
+    packet_t recv_packet;
+    if (receive_packet(socket, &recv_packet, NULL, NULL) == -1)
+    {
+        fprintf(stderr, "ERROR: Could not receive packet\n");
+        return -1;
+    }
+
+    result = (recv_packet.operation == IMG_OP_ACK) ? 0 : -1;
+    return result;
+}
 
-    fseek(img, 0, SEEK_END);
-    const int SIZE = ftell(img);
-    fseek(img, 0, SEEK_SET);
+// copies the image into the next shared memory slot and sends an IMG_OP_ROTATE_SHM request for it
+// returns 0 on success, -1 on failure, or 1 if the image does not fit a slot
+int send_file_shared(int socket, char *input_dir, request_t *request)
+{
+    int SIZE;
+    int img_fd = open_input_file(input_dir, request, &SIZE);
+    if (img_fd == -1)
+        return -1;
+
+    if (SIZE > SHM_SLOT_SIZE - SHM_SLOT_DATA_OFFSET)
+    {
+        close(img_fd);
+        return 1;
+    }
+
+    // the image is copied once, from the page cache straight into the slot
+    uint8_t *img = NULL;
+    if (SIZE > 0 && (img = mmap(NULL, SIZE, PROT_READ, MAP_PRIVATE, img_fd, 0)) == MAP_FAILED)
+    {
+        fprintf(stderr, "ERROR: Could not map file\n");
+        close(img_fd);
+        return -1;
+    }
+    close(img_fd);
+
+    int slot = next_slot;
+    next_slot = (next_slot + 1) % SHM_NUM_SLOTS;
+
+    shm_slot_header_t *header = (shm_slot_header_t *)(shm_base + (size_t)slot * SHM_SLOT_SIZE);
+    if (img != NULL)
+    {
+        memcpy((uint8_t *)header + SHM_SLOT_DATA_OFFSET, img, SIZE);
+        munmap(img, SIZE);
+    }
+    header->in_size  = SIZE;
+    header->out_size = 0;
+
+    packet_t packet;
+    packet.operation = IMG_OP_ROTATE_SHM;
+    if (request->angle == 180)
+        packet.flags = IMG_FLAG_ROTATE_180;
+    else if (request->angle == 270)
+        packet.flags = IMG_FLAG_ROTATE_270;
+    packet.size = slot;
+
+    char serialized_data[PACKET_SIZE];
+    int header_size = serialize_packet(&packet, serialized_data);
+    int result = 0;
+    if (send(socket, serialized_data, header_size, 0) == -1)
+    {
+        fprintf(stderr, "Error: Could not send request data");
+        result = -1;
+    }
+
+    request->slot = slot;
+    return result;
+}
+
+// sends `size` bytes of the open file `fd` from `offset` on; the kernel takes them straight from the page cache
+// returns 0 on success, -1 on failure
+int send_file_data(int socket, int fd, off_t offset, int size)
+{
+    off_t end = offset + size;
+    while (offset < end)
+    {
+        ssize_t sent = sendfile(socket, fd, &offset, end - offset);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+        {
+            fprintf(stderr, "ERROR: Could not send image data\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// -R: reads the header of the PGM (P5) or PPM (P6) file `fd` of `file_size` bytes into `raw`, in host
+// byte order, and stores where its pixels start in `*data_offset`; returns 0 on success, -1 otherwise
+int read_netpbm_header(int fd, int file_size, packet_raw_image_t *raw, int *data_offset)
+{
+    char header[NETPBM_HEADER_MAX];
+    int length = pread(fd, header, sizeof(header), 0);
+    if (length < 3 || header[0] != 'P' || (header[1] != '5' && header[1] != '6'))
+        return -1;
+
+    // width, height and maxval, each after whitespace and any comments
+    long fields[3];
+    int pos = 2;
+    for (int i = 0; i < 3; i++)
+    {
+        while (pos < length && (isspace((unsigned char)header[pos]) || header[pos] == '#'))
+        {
+            if (header[pos] == '#')
+                while (pos < length && header[pos] != '\n')
+                    pos++;
+            else
+                pos++;
+        }
+        if (pos == length || !isdigit((unsigned char)header[pos]))
+            return -1;
+        fields[i] = 0;
+        while (pos < length && isdigit((unsigned char)header[pos]) && fields[i] <= INT_MAX)
+            fields[i] = fields[i] * 10 + (header[pos++] - '0');
+    }
+
+    // a single whitespace character separates the header from the pixels
+    if (pos == length || !isspace((unsigned char)header[pos]) || fields[2] < 1 || fields[2] > 255)
+        return -1;
+
+    raw->width    = fields[0];
+    raw->height   = fields[1];
+    raw->channels = header[1] == '5' ? 1 : 3;
+    raw->stride   = raw->width * raw->channels;
+    *data_offset  = pos + 1;
+    if (fields[0] < 1 || fields[1] < 1 || fields[0] > INT_MAX / 3 ||
+        (long)raw->stride * raw->height > file_size - *data_offset)
+        return -1;
+    return 0;
+}
+
+// -R: appends the layout of the raw pixels to the v2 header in `serialized_data`, `header_size` bytes so far
+// returns the new header size
+int append_raw_image(char *serialized_data, int header_size, packet_raw_image_t *raw)
+{
+    packet_tlv_t tlv;
+    tlv.type   = htons(PACKET_TLV_RAW_IMAGE);
+    tlv.length = htons(sizeof(packet_raw_image_t));
+
+    packet_raw_image_t value;
+    value.width    = htonl(raw->width);
+    value.height   = htonl(raw->height);
+    value.channels = htonl(raw->channels);
+    value.stride   = htonl(raw->stride);
+
+    memcpy(serialized_data + header_size, &tlv, sizeof(packet_tlv_t));
+    memcpy(serialized_data + header_size + sizeof(packet_tlv_t), &value, sizeof(packet_raw_image_t));
+    ((packet_v2_t *)serialized_data)->ext_length = htonl(sizeof(packet_tlv_t) + sizeof(packet_raw_image_t));
+    return header_size + sizeof(packet_tlv_t) + sizeof(packet_raw_image_t);
+}
+
+int send_file(int socket, char *input_dir, request_t *request)
+{
+    // Open the file
+    int SIZE;
+    int img_fd = open_input_file(input_dir, request, &SIZE);
+    if (img_fd == -1)
+        return -1;
+
+    // with -R only the pixels after the netpbm header go out
+    packet_raw_image_t raw;
+    int data_offset = 0;
+    if (raw_pixels)
+    {
+        if (read_netpbm_header(img_fd, SIZE, &raw, &data_offset) == -1)
+        {
+            fprintf(stderr, "ERROR: %s is not a PGM or PPM image\n", request->file_name);
+            close(img_fd);
+            return -1;
+        }
+        SIZE = raw.stride * raw.height;
+    }
+
+    // v1 carries only 16 bits of size, so a bigger image would arrive truncated
+    if (protocol_version != PACKET_V2_VERSION && SIZE > UINT16_MAX)
+    {
+        fprintf(stderr, "ERROR: %s is too big for protocol v1\n", request->file_name);
+        close(img_fd);
+        return -1;
+    }
 
     // Set up the request packet for the server and send it
     packet_t packet;
@@ -152,47 +575,254 @@ int send_file(int socket, char *input_dir, request_t *request)
         packet.flags = IMG_FLAG_ROTATE_270;
     packet.size = SIZE;
 
-    char *serialized_data = serialize_packet(&packet);
+    char serialized_data[PACKET_SIZE];
+    int header_size = serialize_packet(&packet, serialized_data);
+    if (raw_pixels)
+        header_size = append_raw_image(serialized_data, header_size, &raw);
 
-    // Send the file data
-    if (send(socket, serialized_data, PACKET_SIZE, 0) == -1)
+    // Send the file data; the header waits to go out in the same segment as the image
+    if (send(socket, serialized_data, header_size, MSG_MORE) == -1)
     {
         fprintf(stderr, "Error: Could not send request data");
+        close(img_fd);
         return -1;
     }
 
-    free(serialized_data);
+    int result = send_file_data(socket, img_fd, data_offset, SIZE);
+    close(img_fd);
+    return result;
+}
+
+// receives a result of `size` bytes into a new buffer, behind a PGM header if `raw` says it came
+// as raw pixels; returns the buffer and stores its length in `*length`, or returns NULL on failure
+uint8_t *receive_result(int socket, int size, packet_raw_image_t *raw, int *length)
+{
+    char header[64];
+    int header_length = 0;
+    if (raw->width > 0)
+    {
+        if (raw->channels != 1 || raw->stride != raw->width || (uint64_t)raw->width * raw->height != (uint64_t)size)
+            return NULL;
+        header_length = sprintf(header, "P5\n%u %u\n255\n", raw->width, raw->height);
+    }
+
+    uint8_t *result = malloc(header_length + size > 0 ? header_length + size : 1);
+    if (result == NULL)
+        return NULL;
+    memcpy(result, header, header_length);
 
-    // prepare image data
-    char img_data[SIZE];
-    memset(img_data, '\0', SIZE);
-    int num_bytes = fread(img_data, sizeof(char), SIZE, img);
-    write(socket, img_data, num_bytes);  
+    if (recv_fully(socket, result + header_length, size) == -1)
+    {
+        free(result);
+        return NULL;
+    }
+    *length = header_length + size;
+    return result;
+}
 
-    return 0;
+// hands a finished result to the writer thread, which frees `data` once it is saved
+void queue_output(char *path, uint8_t *data, int size)
+{
+    output_t *output = malloc(sizeof(output_t));
+    output->path = strdup(path);
+    output->data = data;
+    output->size = size;
+    job_queue_push(&output_queue, output);
+}
+
+// appends a batch of results to the pack; with -F the batch is synced before the next one is taken
+void pack_batch(output_t **batch, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        char *name = strrchr(batch[i]->path, '/');
+        name = (name != NULL) ? name + 1 : batch[i]->path;
+        if (pack_append(&output_pack, name, batch[i]->data, batch[i]->size) == -1)
+        {
+            fprintf(stderr, "ERROR: Cannot add %s to the pack\n", name);
+            output_failed = true;
+        }
+
+        free(batch[i]->path);
+        free(batch[i]->data);
+        free(batch[i]);
+    }
+
+    if (sync_outputs && count > 0)
+        pack_sync(&output_pack);
+}
+
+// writes a batch of results to hidden temp files next to their final names and renames them into
+// place, so a reader never sees a partial image; with -F one sync covers the whole batch
+void write_outputs(output_t **batch, int count, char *output_dir)
+{
+    int fds[count];
+    char *temp_paths[count];
+
+    for (int i = 0; i < count; i++)
+    {
+        char *name = strrchr(batch[i]->path, '/');
+        name = (name != NULL) ? name + 1 : batch[i]->path;
+        temp_paths[i] = malloc(strlen(batch[i]->path) + 6);
+        sprintf(temp_paths[i], "%.*s.%s.tmp", (int)(name - batch[i]->path), batch[i]->path, name);
+
+        fds[i] = open(temp_paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        int written = 0;
+        while (fds[i] != -1 && written < batch[i]->size)
+        {
+            ssize_t new_bytes = write(fds[i], batch[i]->data + written, batch[i]->size - written);
+            if (new_bytes == -1 && errno == EINTR)
+                continue;
+            if (new_bytes <= 0)
+            {
+                close(fds[i]);
+                unlink(temp_paths[i]);
+                fds[i] = -1;
+                break;
+            }
+            written += new_bytes;
+        }
+
+        if (fds[i] == -1)
+        {
+            fprintf(stderr, "ERROR: Cannot write file location %s\n", batch[i]->path);
+            output_failed = true;
+        }
+    }
+
+    // the data has to be on disk before the names point at it, so a batch that failed to sync is not published
+    bool synced = true;
+    for (int i = 0; i < count && sync_outputs; i++)
+    {
+        if (fds[i] != -1)
+        {
+            if (syncfs(fds[i]) == -1)
+            {
+                fprintf(stderr, "ERROR: Could not sync a batch of results to disk\n");
+                output_failed = true;
+                synced = false;
+            }
+            break;
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (fds[i] != -1)
+        {
+            close(fds[i]);
+            if (!synced)
+                unlink(temp_paths[i]);
+            else if (rename(temp_paths[i], batch[i]->path) == -1)
+            {
+                fprintf(stderr, "ERROR: Cannot publish file location %s\n", batch[i]->path);
+                unlink(temp_paths[i]);
+                output_failed = true;
+            }
+        }
+
+        free(temp_paths[i]);
+        free(batch[i]->path);
+        free(batch[i]->data);
+        free(batch[i]);
+    }
+
+    // and the renames have to be on disk before the batch counts as saved
+    if (sync_outputs)
+    {
+        int dir_fd = open(output_dir, O_RDONLY | O_DIRECTORY);
+        if (dir_fd == -1 || fsync(dir_fd) == -1)
+        {
+            fprintf(stderr, "ERROR: Could not sync the output directory\n");
+            output_failed = true;
+        }
+        if (dir_fd != -1)
+            close(dir_fd);
+    }
 }
 
+// takes results off the output queue until it finds the NULL pushed at exit
+void *output_writer(void *arg)
+{
+    char *output_dir = arg;
+
+    if (pack_outputs)
+    {
+        const int PACK_PATH_LENGTH = strlen(output_dir) + strlen(PACK_FILE_NAME) + 2;
+        char pack_location[PACK_PATH_LENGTH];
+        sprintf(pack_location, "%s/%s", output_dir, PACK_FILE_NAME);
+        if (pack_open(&output_pack, pack_location) == -1)
+        {
+            fprintf(stderr, "ERROR: Cannot create pack %s\n", pack_location);
+            output_failed = true;
+            pack_outputs = false;
+        }
+    }
+
+    while (true)
+    {
+        output_t *batch[WRITER_BATCH];
+        int count = 0;
+
+        // everything already waiting goes into the same batch
+        batch[count++] = job_queue_pop(&output_queue);
+        while (count < WRITER_BATCH && batch[count - 1] != NULL && job_queue_length(&output_queue) > 0)
+            batch[count++] = job_queue_pop(&output_queue);
+
+        bool done = (batch[count - 1] == NULL);
+        if (done)
+            count--;
+
+        if (pack_outputs)
+            pack_batch(batch, count);
+        else
+            write_outputs(batch, count, output_dir);
+
+        if (done)
+        {
+            // the index goes at the end, and only then does the pack appear under its name
+            if (pack_outputs && pack_close(&output_pack, sync_outputs) == -1)
+            {
+                fprintf(stderr, "ERROR: Cannot finish the pack\n");
+                output_failed = true;
+            }
+            return NULL;
+        }
+    }
+}
+
+// returns 0 on success, -1 on failure, or the server's retry-after
+// hint in milliseconds if it was too busy to take the request
 int receive_file(int socket, char *output_dir, request_t *request)
 {
     // Open the file
-    const int IMG_PATH_LENGTH = strlen(output_dir) + strlen(request->file_name) + 1;
+    const int IMG_PATH_LENGTH = strlen(output_dir) + strlen(request->file_name) + 2;
     char img_location[IMG_PATH_LENGTH];
     sprintf(img_location, "%s/%s", output_dir, request->file_name);
 
     // Receive response packet
-    char recv_data[PACKET_SIZE];
-    memset(recv_data, '\0', PACKET_SIZE);
-
-    if (recv(socket, recv_data, PACKET_SIZE, 0) == -1)
+    packet_t recv_packet;
+    packet_raw_image_t raw;
+    if (receive_packet(socket, &recv_packet, NULL, &raw) == -1)
     {
         fprintf(stderr, "ERROR: Could not receive packet\n");
         return -1;
     }
 
-    packet_t *recv_packet = deserialize_data(recv_data);
-
-    if (recv_packet->operation == IMG_OP_ACK) { }
-    else if (recv_packet->operation == IMG_OP_NAK) { return -1; } 
+    if (recv_packet.operation == IMG_OP_ACK) { }
+    else if (recv_packet.operation == IMG_OP_NAK && share_paths)
+    {
+        // a file the server could not open or process fails only its own request
+        fprintf(stderr, "ERROR: Server could not process %s\n", request->file_name);
+        output_failed = true;
+        return 0;
+    }
+    else if (recv_packet.operation == IMG_OP_NAK) { return -1; } 
+    else if (recv_packet.operation == IMG_OP_BUSY)
+    {
+        int retry_ms = recv_packet.size > 0 ? recv_packet.size : 1;
+        return retry_ms;
+    }
     else 
     {
         fprintf(stderr, "Received invalid operation\n");
@@ -200,59 +830,669 @@ int receive_file(int socket, char *output_dir, request_t *request)
     }
 
     // Receive the file data
-    const int SIZE = recv_packet->size;
+    const int SIZE = recv_packet.size;
+
+    // the server already wrote the result into the output file we passed or named
+    if (pass_fds || share_paths)
+        return 0;
+
+    // or into the shared memory slot the image was sent in, unless it did not fit there
+    shm_slot_header_t *header = NULL;
+    if (request->slot != -1)
+        header = (shm_slot_header_t *)(shm_base + (size_t)request->slot * SHM_SLOT_SIZE);
+    request->slot = -1;
+
+    // the slot is reused a few requests from now, so the writer gets its own copy
+    if (header != NULL && header->out_size > 0)
+    {
+        uint8_t *result = malloc(header->out_size);
+        if (result == NULL)
+        {
+            fprintf(stderr, "ERROR: Could not allocate receive buffer\n");
+            return -1;
+        }
+        memcpy(result, (uint8_t *)header + SHM_SLOT_DATA_OFFSET, header->out_size);
+        queue_output(img_location, result, header->out_size);
+        return 0;
+    }
+
+    // the ACK says how big the image is, so it arrives in one read into a buffer that fits
+    int length;
+    uint8_t *result = receive_result(socket, SIZE, &raw, &length);
+    if (result == NULL)
+    {
+        fprintf(stderr, "ERROR: Could not receive image data\n");
+        return -1;
+    }
+
+    // the writer thread saves it while the next image goes out
+    queue_output(img_location, result, length);
+    return 0;
+}
+
+// returns the size of the request's input image, or -1 if it cannot be found
+long input_file_size(char *input_dir, request_t *request)
+{
+    const int IMG_PATH_LENGTH = strlen(input_dir) + strlen(request->file_name) + 2;
+    char img_location[IMG_PATH_LENGTH];
+    sprintf(img_location, "%s/%s", input_dir, request->file_name);
+
+    struct stat img_stat;
+    if (stat(img_location, &img_stat) == -1)
+        return -1;
+    return img_stat.st_size;
+}
+
+// starts a batch with `first` and adds the small images queued after it, as long as the batch stays
+// within its limits; the request that would not fit is stored in `*leftover` to be sent next
+// returns how many requests are in `batch`, 1 if `first` is best sent on its own
+int gather_batch(char *input_dir, request_t *first, request_t **batch, request_t **leftover)
+{
+    batch[0] = first;
+    int count = 1;
+
+    long bytes = input_file_size(input_dir, first);
+    if (bytes < 0 || bytes > BATCH_ITEM_MAX_BYTES)
+        return count;
+
+    while (count < BATCH_MAX_ITEMS && !request_queue_empty())
+    {
+        request_t *request = get_request();
+        long size = input_file_size(input_dir, request);
+        if (size < 0 || size > BATCH_ITEM_MAX_BYTES || bytes + size > BATCH_MAX_BYTES)
+        {
+            *leftover = request;
+            break;
+        }
+        batch[count++] = request;
+        bytes += size;
+    }
+    return count;
+}
+
+// sends the images of `batch` as one IMG_OP_BATCH request, behind a table of where each one is
+// returns 0 on success, -1 on failure
+int send_batch(int socket, char *input_dir, request_t **batch, int count)
+{
+    int fds[BATCH_MAX_ITEMS];
+    int sizes[BATCH_MAX_ITEMS];
+    int opened = 0;
+    for (; opened < count; opened++)
+    {
+        if ((fds[opened] = open_input_file(input_dir, batch[opened], &sizes[opened])) == -1)
+            break;
+    }
+
+    // the header, then the table, then the images in table order
+    char serialized_data[PACKET_SIZE + sizeof(batch_header_t) + BATCH_MAX_ITEMS * sizeof(batch_item_t)];
+    int table_size = sizeof(batch_header_t) + count * sizeof(batch_item_t);
+    long payload_size = table_size;
+
+    batch_header_t header;
+    header.count = htonl(count);
+    for (int i = 0; i < opened; i++)
+    {
+        batch_item_t item;
+        item.status = 0;
+        item.offset = htonl(payload_size);
+        item.size   = htonl(sizes[i]);
+        memcpy(serialized_data + PACKET_SIZE + sizeof(batch_header_t) + i * sizeof(batch_item_t), &item, sizeof(batch_item_t));
+        payload_size += sizes[i];
+    }
+
+    int result = (opened == count && payload_size <= INT_MAX) ? 0 : -1;
+    if (result == 0)
+    {
+        packet_t packet;
+        packet.operation = IMG_OP_BATCH;
+        packet.flags = (batch[0]->angle == 180) ? IMG_FLAG_ROTATE_180 : IMG_FLAG_ROTATE_270;
+        packet.size = payload_size;
+
+        char packet_data[PACKET_SIZE];
+        int header_size = serialize_packet(&packet, packet_data);
+        memcpy(serialized_data + PACKET_SIZE - header_size, packet_data, header_size);
+        memcpy(serialized_data + PACKET_SIZE, &header, sizeof(batch_header_t));
+
+        // the header and table wait to go out in the same segment as the first image
+        if (send(socket, serialized_data + PACKET_SIZE - header_size, header_size + table_size, MSG_MORE) == -1)
+            result = -1;
+    }
+
+    for (int i = 0; i < opened; i++)
+    {
+        if (result == 0)
+            result = send_file_data(socket, fds[i], 0, sizes[i]);
+        close(fds[i]);
+    }
+    return result;
+}
+
+// receives the answer to a batch and queues every result it holds for the writer; an image the
+// server could not process fails only itself
+// returns 0 on success, -1 on failure, or the server's retry-after hint in milliseconds
+int receive_batch(int socket, char *output_dir, request_t **batch, int count)
+{
+    packet_t recv_packet;
+    if (receive_packet(socket, &recv_packet, NULL, NULL) == -1)
+    {
+        fprintf(stderr, "ERROR: Could not receive packet\n");
+        return -1;
+    }
 
-    free(recv_packet);
+    if (recv_packet.operation == IMG_OP_BUSY)
+        return recv_packet.size > 0 ? recv_packet.size : 1;
+    if (recv_packet.operation != IMG_OP_ACK)
+    {
+        fprintf(stderr, "ERROR: Server refused a batch\n");
+        return -1;
+    }
 
-    // Write the data to the file
-    FILE *testfile;
-    if ((testfile = fopen(img_location, "w")) == NULL)
+    const int SIZE = recv_packet.size;
+    uint8_t *results = malloc(SIZE > 0 ? SIZE : 1);
+    if (results == NULL || recv_fully(socket, results, SIZE) == -1)
     {
-        fprintf(stderr, "ERROR: Cannot open file location %s\n", img_location);
+        fprintf(stderr, "ERROR: Could not receive batch results\n");
+        free(results);
         return -1;
     }
 
-    int num_bytes = 0;
-    char buf[BUFF_SIZE];
+    batch_header_t header;
+    int table_size = sizeof(batch_header_t) + count * sizeof(batch_item_t);
+    if (SIZE >= table_size)
+        memcpy(&header, results, sizeof(batch_header_t));
+    if (SIZE < table_size || ntohl(header.count) != (uint32_t)count)
+    {
+        fprintf(stderr, "ERROR: Malformed batch results\n");
+        free(results);
+        return -1;
+    }
 
-    while (num_bytes < SIZE)
+    for (int i = 0; i < count; i++)
     {
-        int new_bytes = read(socket, buf, BUFF_SIZE);
-        num_bytes += new_bytes;
-        fwrite(buf, sizeof(char), new_bytes, testfile);
+        batch_item_t item;
+        memcpy(&item, results + sizeof(batch_header_t) + i * sizeof(batch_item_t), sizeof(batch_item_t));
+        uint32_t offset = ntohl(item.offset);
+        uint32_t size   = ntohl(item.size);
+        if (ntohl(item.status) != IMG_OP_ACK || offset < (uint32_t)table_size || (uint64_t)offset + size > (uint64_t)SIZE)
+        {
+            fprintf(stderr, "ERROR: Server could not process %s\n", batch[i]->file_name);
+            output_failed = true;
+            continue;
+        }
+
+        uint8_t *result = malloc(size > 0 ? size : 1);
+        if (result == NULL)
+        {
+            fprintf(stderr, "ERROR: Could not allocate receive buffer\n");
+            free(results);
+            return -1;
+        }
+        memcpy(result, results + offset, size);
+
+        const int IMG_PATH_LENGTH = strlen(output_dir) + strlen(batch[i]->file_name) + 2;
+        char img_location[IMG_PATH_LENGTH];
+        sprintf(img_location, "%s/%s", output_dir, batch[i]->file_name);
+        queue_output(img_location, result, size);
     }
 
-    fclose(testfile);
+    free(results);
     return 0;
 }
 
+// sends `batch` until the server takes it, receives its results and frees its requests
+// returns 0 on success, -1 on failure
+int process_batch(int socket, char *input_dir, char *output_dir, request_t **batch, int count)
+{
+    int result;
+    do
+    {
+        if (send_batch(socket, input_dir, batch, count) == -1)
+            return -1;
+        if ((result = receive_batch(socket, output_dir, batch, count)) == -1)
+            return -1;
+
+        // the server is overloaded, back off for as long as it asked
+        if (result > 0)
+            usleep(result * 1000);
+    } while (result > 0);
+
+    for (int i = 0; i < count; i++)
+    {
+        free(batch[i]->file_name);
+        free(batch[i]);
+    }
+    return 0;
+}
+
+// -T: takes the results of a stream off the socket as they come back and queues them for the writer
+void *stream_receiver(void *arg)
+{
+    stream_args_t *args = arg;
+
+    while (true)
+    {
+        stream_entry_t entry;
+        if (recv_fully(args->socket, &entry, sizeof(entry)) == -1)
+        {
+            fprintf(stderr, "ERROR: Could not receive stream entry\n");
+            args->failed = true;
+            return NULL;
+        }
+
+        uint32_t name_length = ntohl(entry.name_length);
+        uint32_t size        = ntohl(entry.size);
+        if (name_length == 0)
+            return NULL;
+
+        char name[NAME_MAX + 1];
+        uint8_t *result = malloc(size > 0 ? size : 1);
+        if (name_length > NAME_MAX || result == NULL ||
+            recv_fully(args->socket, name, name_length) == -1 || recv_fully(args->socket, result, size) == -1)
+        {
+            fprintf(stderr, "ERROR: Could not receive stream entry\n");
+            free(result);
+            args->failed = true;
+            return NULL;
+        }
+        name[name_length] = '\0';
+
+        // the name only ever comes back as we sent it, but it must not leave the output directory
+        if (ntohl(entry.status) != IMG_OP_ACK || strchr(name, '/') != NULL)
+        {
+            fprintf(stderr, "ERROR: Server could not process %s\n", name);
+            free(result);
+            args->failed = true;
+            continue;
+        }
+
+        const int IMG_PATH_LENGTH = strlen(args->output_dir) + name_length + 2;
+        char img_location[IMG_PATH_LENGTH];
+        sprintf(img_location, "%s/%s", args->output_dir, name);
+        queue_output(img_location, result, size);
+    }
+}
+
+// -T: sends every queued image as one IMG_OP_STREAM request while a second thread takes the results
+// returns 0 on success, -1 if the stream broke, 1 if some images came back as failed
+int stream_directory(int socket, char *input_dir, char *output_dir, int angle)
+{
+    packet_t packet;
+    packet.operation = IMG_OP_STREAM;
+    packet.flags = (angle == 270) ? IMG_FLAG_ROTATE_270 : IMG_FLAG_ROTATE_180;
+    packet.size = 0;
+
+    char serialized_data[PACKET_SIZE];
+    int header_size = serialize_packet(&packet, serialized_data);
+    if (send(socket, serialized_data, header_size, 0) != header_size)
+    {
+        fprintf(stderr, "Error: Could not send request data");
+        return -1;
+    }
+
+    stream_args_t args;
+    args.socket     = socket;
+    args.output_dir = output_dir;
+    args.failed     = false;
+
+    pthread_t receiver;
+    if (pthread_create(&receiver, NULL, stream_receiver, &args) != 0)
+        return -1;
+
+    int result = 0;
+    while (!request_queue_empty() && result == 0)
+    {
+        request_t *request = get_request();
+        int name_length = strlen(request->file_name);
+
+        int size;
+        int img_fd = open_input_file(input_dir, request, &size);
+        if (img_fd == -1 || name_length > NAME_MAX)
+            result = -1;
+
+        // entry header and name in one segment, then the image straight from the page cache
+        if (result == 0)
+        {
+            char header[sizeof(stream_entry_t) + NAME_MAX];
+            stream_entry_t *entry = (stream_entry_t *)header;
+            entry->name_length = htonl(name_length);
+            entry->size        = htonl(size);
+            entry->status      = 0;
+            memcpy(header + sizeof(stream_entry_t), request->file_name, name_length);
+
+            int header_size = sizeof(stream_entry_t) + name_length;
+            if (send(socket, header, header_size, MSG_MORE) != header_size ||
+                send_file_data(socket, img_fd, 0, size) == -1)
+                result = -1;
+        }
+
+        if (img_fd != -1)
+            close(img_fd);
+        free(request->file_name);
+        free(request);
+    }
+
+    // the empty entry ends the stream; if it broke, shutting the socket down wakes the receiver
+    stream_entry_t end;
+    memset(&end, 0, sizeof(end));
+    if (result == -1 || send(socket, &end, sizeof(end), 0) != sizeof(end))
+    {
+        result = -1;
+        shutdown(socket, SHUT_RDWR);
+    }
+
+    pthread_join(receiver, NULL);
+    if (result == 0 && args.failed)
+        result = 1;
+    return result;
+}
+
+// -w: the receiver lost the connection, so the sender is woken up to stop
+void multiplex_broken(multiplex_args_t *args)
+{
+    pthread_mutex_lock(&args->lock);
+    args->broken = true;
+    pthread_cond_broadcast(&args->changed);
+    pthread_mutex_unlock(&args->lock);
+    shutdown(args->socket, SHUT_RDWR);
+}
+
+// -w: takes the replies of a multiplexed connection off the socket in whatever order they come,
+// queues each result for the writer and frees its request id
+void *multiplex_receiver(void *arg)
+{
+    multiplex_args_t *args = arg;
+
+    while (true)
+    {
+        // nothing more is owed once the sender is done and every reply is in
+        pthread_mutex_lock(&args->lock);
+        while (args->in_flight == 0 && !args->sending_done)
+            pthread_cond_wait(&args->changed, &args->lock);
+        bool finished = (args->in_flight == 0);
+        pthread_mutex_unlock(&args->lock);
+        if (finished)
+            return NULL;
+
+        packet_t packet;
+        packet_raw_image_t raw;
+        uint32_t id;
+        char *name = NULL;
+        if (receive_packet(args->socket, &packet, &id, &raw) == 0 && id < (uint32_t)args->window)
+        {
+            pthread_mutex_lock(&args->lock);
+            name = args->names[id];
+            pthread_mutex_unlock(&args->lock);
+        }
+        if (name == NULL || (packet.operation != IMG_OP_ACK && packet.operation != IMG_OP_NAK))
+        {
+            fprintf(stderr, "ERROR: Could not receive packet\n");
+            multiplex_broken(args);
+            return NULL;
+        }
+
+        if (packet.operation == IMG_OP_ACK)
+        {
+            int length;
+            uint8_t *result = receive_result(args->socket, packet.size, &raw, &length);
+            if (result == NULL)
+            {
+                fprintf(stderr, "ERROR: Could not receive image data\n");
+                multiplex_broken(args);
+                return NULL;
+            }
+
+            const int IMG_PATH_LENGTH = strlen(args->output_dir) + strlen(name) + 2;
+            char img_location[IMG_PATH_LENGTH];
+            sprintf(img_location, "%s/%s", args->output_dir, name);
+            queue_output(img_location, result, length);
+        }
+        else
+        {
+            fprintf(stderr, "ERROR: Server could not process %s\n", name);
+            args->failed = true;
+        }
+
+        pthread_mutex_lock(&args->lock);
+        free(args->names[id]);
+        args->names[id] = NULL;
+        args->in_flight--;
+        pthread_cond_broadcast(&args->changed);
+        pthread_mutex_unlock(&args->lock);
+    }
+}
+
+// -w: keeps up to `window` requests in flight on one IMG_OP_MULTIPLEX connection while a second
+// thread takes the replies as they finish, then ends the connection with IMG_OP_EXIT
+// returns 0 on success, -1 if the connection broke, 1 if some images came back as failed
+int multiplex_directory(int socket, char *input_dir, char *output_dir, int window)
+{
+    packet_t packet;
+    packet.operation = IMG_OP_MULTIPLEX;
+    packet.flags = 0;
+    packet.size = window;
+
+    // the ACK says how many requests the server lets us have in flight
+    char serialized_data[PACKET_SIZE];
+    int header_size = serialize_packet(&packet, serialized_data);
+    packet_t granted;
+    if (send(socket, serialized_data, header_size, 0) != header_size ||
+        receive_packet(socket, &granted, NULL, NULL) == -1 || granted.operation != IMG_OP_ACK || granted.size < 1)
+    {
+        fprintf(stderr, "Error: The server did not accept multiplexed requests\n");
+        return -1;
+    }
+
+    multiplex_args_t args;
+    args.socket       = socket;
+    args.output_dir   = output_dir;
+    args.window       = granted.size;
+    args.names        = calloc(args.window, sizeof(char *));
+    args.in_flight    = 0;
+    args.sending_done = false;
+    args.broken       = false;
+    args.failed       = false;
+    pthread_mutex_init(&args.lock, NULL);
+    pthread_cond_init(&args.changed, NULL);
+
+    pthread_t receiver;
+    if (args.names == NULL || pthread_create(&receiver, NULL, multiplex_receiver, &args) != 0)
+    {
+        free(args.names);
+        return -1;
+    }
+
+    int result = 0;
+    while (!request_queue_empty() && result == 0)
+    {
+        request_t *request = get_request();
+
+        // wait for a reply to free an id
+        pthread_mutex_lock(&args.lock);
+        while (args.in_flight == args.window && !args.broken)
+            pthread_cond_wait(&args.changed, &args.lock);
+        int id = 0;
+        while (id < args.window && args.names[id] != NULL)
+            id++;
+        if (args.broken)
+            result = -1;
+        else
+        {
+            args.names[id] = strdup(request->file_name);
+            args.in_flight++;
+            pthread_cond_broadcast(&args.changed);
+        }
+        pthread_mutex_unlock(&args.lock);
+
+        // the request goes out under the id its reply is matched by
+        next_request_id = id;
+        if (result == 0 && send_file(socket, input_dir, request) == -1)
+            result = -1;
+
+        free(request->file_name);
+        free(request);
+    }
+
+    // if sending broke, shutting the socket down wakes the receiver
+    if (result == -1 || terminate_connection(socket) == -1)
+    {
+        result = -1;
+        shutdown(socket, SHUT_RDWR);
+    }
+
+    pthread_mutex_lock(&args.lock);
+    args.sending_done = true;
+    pthread_cond_broadcast(&args.changed);
+    pthread_mutex_unlock(&args.lock);
+
+    pthread_join(receiver, NULL);
+    if (args.broken)
+        result = -1;
+    if (result == 0 && args.failed)
+        result = 1;
+
+    for (int i = 0; i < args.window; i++)
+        free(args.names[i]);
+    free(args.names);
+    pthread_mutex_destroy(&args.lock);
+    pthread_cond_destroy(&args.changed);
+    return result;
+}
+
 int main(int argc, char* argv[])
 {
-    if(argc != 4)
+    char *socket_path = NULL;
+    bool use_shm = false;
+    bool stream_mode = false;
+    int multiplex_window = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "u:fmFPTp1w:RB")) != -1)
+    {
+        switch (opt)
+        {
+            case 'u':
+                socket_path = optarg;
+                break;
+            case 'f':
+                pass_fds = true;
+                break;
+            case 'm':
+                use_shm = true;
+                break;
+            case 'F':
+                sync_outputs = true;
+                break;
+            case 'P':
+                pack_outputs = true;
+                break;
+            case 'T':
+                stream_mode = true;
+                break;
+            case 'p':
+                share_paths = true;
+                break;
+            case '1':
+                protocol_version = 1;
+                break;
+            case 'R':
+                raw_pixels = true;
+                break;
+            case 'B':
+                batch_images = false;
+                break;
+            case 'w':
+                multiplex_window = atoi(optarg);
+                if (multiplex_window < 1)
+                    optind = argc + 1;
+                break;
+            default:
+                optind = argc + 1;   // falls into the usage message below
+                break;
+        }
+    }
+
+    if(argc - optind != 3)
+    {
+        fprintf(stderr, "Usage: ./client [-u socket_path] [-f | -m | -T | -p | -w window] [-R] [-B] [-F] [-P] [-1] File_Path_to_images File_Path_to_output_dir Rotation_angle. \n");
+        return 1;
+    }
+
+    // with -f the server writes the results itself, so there is nothing to pack
+    if (pass_fds && pack_outputs)
+    {
+        fprintf(stderr, "Error: -P cannot be combined with -f\n");
+        return 1;
+    }
+    if (stream_mode && (pass_fds || use_shm))
+    {
+        fprintf(stderr, "Error: -T cannot be combined with -f or -m\n");
+        return 1;
+    }
+    if (share_paths && (pass_fds || use_shm || stream_mode || pack_outputs))
+    {
+        fprintf(stderr, "Error: -p cannot be combined with -f, -m, -T or -P\n");
+        return 1;
+    }
+    if (multiplex_window > 0 && (pass_fds || use_shm || stream_mode || share_paths || protocol_version != PACKET_V2_VERSION))
+    {
+        fprintf(stderr, "Error: -w cannot be combined with -f, -m, -T, -p or -1\n");
+        return 1;
+    }
+    if (raw_pixels && (pass_fds || use_shm || stream_mode || share_paths || protocol_version != PACKET_V2_VERSION))
     {
-        fprintf(stderr, "Usage: ./client File_Path_to_images File_Path_to_output_dir Rotation_angle. \n");
+        fprintf(stderr, "Error: -R cannot be combined with -f, -m, -T, -p or -1\n");
         return 1;
     }
 
-    char *img_dir = argv[1];
-    char *output_dir = argv[2];
-    int rotation_angle = atoi(argv[3]);
+    // batches only go over the socket, in v2 headers, as encoded images
+    if (pass_fds || use_shm || share_paths || raw_pixels || protocol_version != PACKET_V2_VERSION)
+        batch_images = false;
+
+    // passing descriptors and sharing memory only work over the local socket
+    if ((pass_fds || use_shm) && socket_path == NULL)
+        socket_path = LOCAL_SOCKET_PATH;
+
+    char *img_dir = argv[optind];
+    char *output_dir = argv[optind + 1];
+    int rotation_angle = atoi(argv[optind + 2]);
+
+    // every mode maps the angle to a flag, so one it cannot express is refused here for all of them
+    if (rotation_angle != 180 && rotation_angle != 270)
+    {
+        fprintf(stderr, "Error: Rotation_angle must be 180 or 270\n");
+        return 1;
+    }
+
+    // with -p the server resolves our paths itself, so they have to be absolute
+    char *shared_input_dir = NULL;
+    char *shared_output_dir = NULL;
+    if (share_paths &&
+        ((shared_input_dir = realpath(img_dir, NULL)) == NULL || (shared_output_dir = realpath(output_dir, NULL)) == NULL))
+    {
+        fprintf(stderr, "Error: Could not resolve the input and output directories\n");
+        return 1;
+    }
 
     init_request_queue();
 
+    pthread_t writer;
+    if (job_queue_init(&output_queue, WRITER_QUEUE_LEN) == -1 ||
+        pthread_create(&writer, NULL, output_writer, output_dir) != 0)
+    {
+        fprintf(stderr, "Error: Could not start the output writer\n");
+        exit(1);
+    }
+
     // Read the directory for all the images to rotate
     DIR *dir = opendir(img_dir);
 
-    int current = 0;
     struct dirent *entry;
     while((entry = readdir(dir)) != NULL)
     {
-        if(current < 2)
-        {
-            current++;
+        // skip `.`, `..` and hidden files, wherever readdir puts them
+        if(entry->d_name[0] == '.')
             continue;
-        }
-        add_request(requests, entry->d_name, rotation_angle);
+        add_request(requests, strdup(entry->d_name), rotation_angle);
     }
 
     // closedir(dir);
@@ -260,7 +1500,7 @@ int main(int argc, char* argv[])
     // print_request_queue();
 
     // Set up socket
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    int sockfd = socket(socket_path != NULL ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
     if(sockfd == -1)
     {
         fprintf(stderr, "Socket Error\n");
@@ -268,45 +1508,127 @@ int main(int argc, char* argv[])
     }
 
     // Connect the socket
-    struct sockaddr_in servaddr;
-    servaddr.sin_family = AF_INET; // IPv4
-    servaddr.sin_addr.s_addr = inet_addr("127.0.0.1"); // server IP (localhost)
-    servaddr.sin_port = htons(PORT);
+    int connected;
+    if (socket_path != NULL)
+    {
+        // the server's local socket, on the same host
+        struct sockaddr_un servaddr;
+        memset(&servaddr, '\0', sizeof(servaddr));
+        servaddr.sun_family = AF_UNIX;
+        strncpy(servaddr.sun_path, socket_path, sizeof(servaddr.sun_path) - 1);
+        connected = connect(sockfd, (struct sockaddr *) &servaddr, sizeof(servaddr));
+    }
+    else
+    {
+        struct sockaddr_in servaddr;
+        servaddr.sin_family = AF_INET; // IPv4
+        servaddr.sin_addr.s_addr = inet_addr("127.0.0.1"); // server IP (localhost)
+        servaddr.sin_port = htons(PORT);
+        connected = connect(sockfd, (struct sockaddr *) &servaddr, sizeof(servaddr));
+    }
 
-    if(connect(sockfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) == -1)
+    if(connected == -1)
     {
         fprintf(stderr, "Error: could not connect\n");
         exit(1);
     }
 
-    while (!request_queue_empty())
+    if (use_shm && attach_shared_memory(sockfd) == -1)
     {
-        request_t *request = get_request(); 
+        fprintf(stderr, "Error: Could not share memory with the server\n");
+        exit(1);
+    }
 
-        // printf("filename: %s\n", request->file_name);
+    // one request for the whole directory
+    int streamed = stream_mode ? stream_directory(sockfd, img_dir, output_dir, rotation_angle) : 0;
+    if (streamed == -1)
+    {
+        fprintf(stderr, "Error: Could not stream the directory\n");
+        exit(1);
+    }
+    if (streamed == 1)
+        output_failed = true;
+
+    // or a window of requests on one connection, each answered as soon as it is done
+    int multiplexed = multiplex_window > 0 ? multiplex_directory(sockfd, img_dir, output_dir, multiplex_window) : 0;
+    if (multiplexed == -1)
+    {
+        fprintf(stderr, "Error: Could not send the multiplexed requests\n");
+        exit(1);
+    }
+    if (multiplexed == 1)
+        output_failed = true;
+
+    request_t *held = NULL;   // the request that ended the last batch, sent next
+    while (held != NULL || !request_queue_empty())
+    {
+        request_t *request = held != NULL ? held : get_request();
+        held = NULL;
 
-        // Send the image data to the server
-        if (send_file(sockfd, img_dir, request) == -1)
+        // small images go out together, one request for the lot
+        if (batch_images)
         {
-            fprintf(stderr, "Error: Could not send file\n");
-            exit(1);
+            request_t *batch[BATCH_MAX_ITEMS];
+            int count = gather_batch(img_dir, request, batch, &held);
+            if (count > 1 && process_batch(sockfd, img_dir, output_dir, batch, count) == -1)
+            {
+                fprintf(stderr, "Error: Could not process a batch\n");
+                exit(1);
+            }
+            if (count > 1)
+                continue;
         }
 
-        // Check that the request was acknowledged
-        if (receive_file(sockfd, output_dir, request) == -1)
+        // printf("filename: %s\n", request->file_name);
+
+        int result;
+        do
         {
-            fprintf(stderr, "Error: File receiving error\n");
-            exit(1);
-        }
+            // Send the image data, or with -f just the files, to the server
+            int sent = 1;
+            if (pass_fds)
+                sent = send_file_descriptors(sockfd, img_dir, output_dir, request);
+            else if (share_paths)
+                sent = send_file_paths(sockfd, shared_input_dir, shared_output_dir, request);
+            else if (use_shm)
+                sent = send_file_shared(sockfd, img_dir, request);
+
+            // images too big for a shared memory slot go over the socket instead
+            if (sent == 1)
+                sent = send_file(sockfd, img_dir, request);
+            if (sent == -1)
+            {
+                fprintf(stderr, "Error: Could not send file\n");
+                exit(1);
+            }
+
+            // Check that the request was acknowledged
+            if ((result = receive_file(sockfd, output_dir, request)) == -1)
+            {
+                fprintf(stderr, "Error: File receiving error\n");
+                exit(1);
+            }
 
+            // the server is overloaded, back off for as long as it asked
+            if (result > 0)
+                usleep(result * 1000);
+        } while (result > 0);
+
+        free(request->file_name);
         free(request);
     }
 
-    if (terminate_connection(sockfd) == -1)
+    // a multiplexed connection was already ended once its last reply came in
+    if (multiplex_window == 0 && terminate_connection(sockfd) == -1)
     {
         fprintf(stderr, "Error: Couldn't terminate connection\n");
         exit(1);
     }
+
+    // wait for the writer to save the last results
+    job_queue_push(&output_queue, NULL);
+    pthread_join(writer, NULL);
+    job_queue_destroy(&output_queue);
     
 
     // Receive the processed image and save it in the output dir
@@ -315,5 +1637,7 @@ int main(int argc, char* argv[])
 
     // Release any resources
     closedir(dir);
-    return 0;
+    free(shared_input_dir);
+    free(shared_output_dir);
+    return output_failed ? 1 : 0;
 }
@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include "job_queue.h"
+
+int job_queue_init(job_queue_t *queue, int capacity)
+{
+    queue->items = malloc(sizeof(void *) * capacity);
+    if (queue->items == NULL)
+        return -1;
+
+    queue->capacity = capacity;
+    queue->head     = 0;
+    queue->count    = 0;
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+
+    return 0;
+}
+
+void job_queue_destroy(job_queue_t *queue)
+{
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->items);
+    queue->items = NULL;
+}
+
+void job_queue_push(job_queue_t *queue, void *item)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity)
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+
+    int tail = (queue->head + queue->count) % queue->capacity;
+    queue->items[tail] = item;
+    queue->count++;
+
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void *job_queue_pop(job_queue_t *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0)
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+
+    void *item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+
+    return item;
+}
+
+int job_queue_length(job_queue_t *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    int count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <sched.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "mpmc_ring.h"
+
+uint32_t futex_prepare_wait(uint32_t *word)
+{
+    uint32_t value = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+    while (!(value & 1))
+    {
+        if (__atomic_compare_exchange_n(word, &value, value | 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return value | 1;
+    }
+    return value;
+}
+
+void futex_wait_word(uint32_t *word, uint32_t expected)
+{
+    // returns early with EAGAIN if a wakeup already happened, and may wake spuriously
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+void futex_wake_waiters(uint32_t *word)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t value = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+
+    // only the first waker after a thread went to sleep pays for the syscall;
+    // clearing the flag bumps the count, so a stale futex_wait_word() returns at once
+    if ((value & 1) && __atomic_compare_exchange_n(word, &value, value + 1, false,
+                                                   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+int mpmc_ring_init(mpmc_ring_t *ring, int capacity)
+{
+    unsigned long size = 2;
+    while (size < (unsigned long)capacity)
+        size <<= 1;
+
+    ring->cells = malloc(sizeof(mpmc_cell_t) * size);
+    if (ring->cells == NULL)
+        return -1;
+
+    // cell i is first free for the producer that claims position i
+    for (unsigned long i = 0; i < size; i++)
+        ring->cells[i].sequence = i;
+
+    ring->mask        = size - 1;
+    ring->enqueue_pos = 0;
+    ring->dequeue_pos = 0;
+    ring->wake_word   = 0;
+
+    return 0;
+}
+
+void mpmc_ring_destroy(mpmc_ring_t *ring)
+{
+    free(ring->cells);
+    ring->cells = NULL;
+}
+
+bool mpmc_ring_try_push(mpmc_ring_t *ring, void *item)
+{
+    unsigned long pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+
+    while (true)
+    {
+        mpmc_cell_t *cell = &ring->cells[pos & ring->mask];
+        unsigned long sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long)sequence - (long)pos;
+
+        if (diff == 0)
+        {
+            // the cell is free; claim it unless another producer got there first
+            if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                cell->item = item;
+                __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+        else if (diff < 0)
+        {
+            // the consumer a lap behind has not emptied the cell yet
+            return false;
+        }
+        else
+        {
+            pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void *mpmc_ring_try_pop(mpmc_ring_t *ring)
+{
+    unsigned long pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+
+    while (true)
+    {
+        mpmc_cell_t *cell = &ring->cells[pos & ring->mask];
+        unsigned long sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long)sequence - (long)(pos + 1);
+
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&ring->dequeue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                void *item = cell->item;
+                // hand the cell to the producer one lap ahead
+                __atomic_store_n(&cell->sequence, pos + ring->mask + 1, __ATOMIC_RELEASE);
+                return item;
+            }
+        }
+        else if (diff < 0)
+        {
+            // no producer has filled the cell yet
+            return NULL;
+        }
+        else
+        {
+            pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void mpmc_ring_push(mpmc_ring_t *ring, void *item)
+{
+    while (!mpmc_ring_try_push(ring, item))
+        sched_yield();
+
+    futex_wake_waiters(&ring->wake_word);
+}
+
+void *mpmc_ring_pop(mpmc_ring_t *ring)
+{
+    while (true)
+    {
+        void *item = mpmc_ring_try_pop(ring);
+        if (item != NULL)
+            return item;
+
+        // announce the sleep before the last look, so a push in between either
+        // shows up in that look or sees the sleeper and wakes it
+        uint32_t expected = futex_prepare_wait(&ring->wake_word);
+        if ((item = mpmc_ring_try_pop(ring)) != NULL)
+            return item;
+        futex_wait_word(&ring->wake_word, expected);
+    }
+}
+
+int mpmc_ring_length(mpmc_ring_t *ring)
+{
+    unsigned long enqueued = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+    unsigned long dequeued = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+    return enqueued > dequeued ? (int)(enqueued - dequeued) : 0;
+}
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "pack.h"
+
+uint32_t crc_table[256];
+pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+void init_crc_table(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        crc_table[i] = crc;
+    }
+}
+
+uint32_t pack_crc32(const uint8_t *data, size_t size)
+{
+    pthread_once(&crc_table_once, init_crc_table);
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; i++)
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+void put_le(uint8_t *dest, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        dest[i] = (value >> (8 * i)) & 0xFF;
+}
+
+uint64_t get_le(const uint8_t *src, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value |= (uint64_t)src[i] << (8 * i);
+    return value;
+}
+
+int write_fully(int fd, const uint8_t *data, size_t size)
+{
+    size_t written = 0;
+    while (written < size)
+    {
+        ssize_t new_bytes = write(fd, data + written, size - written);
+        if (new_bytes == -1 && errno == EINTR)
+            continue;
+        if (new_bytes <= 0)
+            return -1;
+        written += new_bytes;
+    }
+    return 0;
+}
+
+int read_fully_at(int fd, uint8_t *dest, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t new_bytes = pread(fd, dest + done, size - done, offset + done);
+        if (new_bytes == -1 && errno == EINTR)
+            continue;
+        if (new_bytes <= 0)
+            return -1;
+        done += new_bytes;
+    }
+    return 0;
+}
+
+int pack_open(pack_writer_t *pack, const char *path)
+{
+    memset(pack, 0, sizeof(pack_writer_t));
+
+    pack->path = strdup(path);
+    pack->temp_path = malloc(strlen(path) + 5);
+    sprintf(pack->temp_path, "%s.tmp", path);
+
+    pack->fd = open(pack->temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (pack->fd == -1 || write_fully(pack->fd, (const uint8_t *)PACK_MAGIC, PACK_MAGIC_SIZE) == -1)
+    {
+        if (pack->fd != -1)
+        {
+            close(pack->fd);
+            unlink(pack->temp_path);
+        }
+        free(pack->path);
+        free(pack->temp_path);
+        return -1;
+    }
+
+    pack->offset = PACK_MAGIC_SIZE;
+    return 0;
+}
+
+int pack_append(pack_writer_t *pack, const char *name, const uint8_t *data, uint64_t size)
+{
+    if (pack->num_entries == pack->capacity)
+    {
+        int capacity = pack->capacity > 0 ? pack->capacity * 2 : 64;
+        pack_entry_t *grown = realloc(pack->entries, sizeof(pack_entry_t) * capacity);
+        if (grown == NULL)
+            return -1;
+        pack->entries  = grown;
+        pack->capacity = capacity;
+    }
+
+    if (write_fully(pack->fd, data, size) == -1)
+        return -1;
+
+    pack_entry_t *entry = &pack->entries[pack->num_entries++];
+    entry->name   = strdup(name);
+    entry->offset = pack->offset;
+    entry->size   = size;
+    entry->crc    = pack_crc32(data, size);
+
+    pack->offset += size;
+    return 0;
+}
+
+int pack_sync(pack_writer_t *pack)
+{
+    return fdatasync(pack->fd);
+}
+
+int pack_close(pack_writer_t *pack, int sync)
+{
+    // the whole index goes out in one write
+    size_t index_size = PACK_TRAILER_SIZE;
+    for (int i = 0; i < pack->num_entries; i++)
+        index_size += 2 + strlen(pack->entries[i].name) + 8 + 8 + 4;
+
+    uint8_t *index = malloc(index_size);
+    uint8_t *pos = index;
+    for (int i = 0; i < pack->num_entries; i++)
+    {
+        pack_entry_t *entry = &pack->entries[i];
+        size_t name_length = strlen(entry->name);
+
+        put_le(pos, name_length, 2);
+        memcpy(pos + 2, entry->name, name_length);
+        pos += 2 + name_length;
+        put_le(pos, entry->offset, 8);
+        put_le(pos + 8, entry->size, 8);
+        put_le(pos + 16, entry->crc, 4);
+        pos += 20;
+    }
+    put_le(pos, pack->offset, 8);
+    put_le(pos + 8, pack->num_entries, 8);
+    memcpy(pos + 16, PACK_INDEX_MAGIC, PACK_MAGIC_SIZE);
+
+    int result = write_fully(pack->fd, index, index_size);
+    if (result == 0 && sync)
+        result = fsync(pack->fd);
+    close(pack->fd);
+
+    if (result == 0)
+        result = rename(pack->temp_path, pack->path);
+    if (result != 0)
+        unlink(pack->temp_path);
+
+    free(index);
+    pack_free_index(pack->entries, pack->num_entries);
+    free(pack->path);
+    free(pack->temp_path);
+    return result == 0 ? 0 : -1;
+}
+
+int pack_read_index(int fd, pack_entry_t **entries)
+{
+    *entries = NULL;
+
+    struct stat pack_stat;
+    if (fstat(fd, &pack_stat) == -1 || pack_stat.st_size < PACK_MAGIC_SIZE + PACK_TRAILER_SIZE)
+        return -1;
+
+    uint8_t magic[PACK_MAGIC_SIZE];
+    uint8_t trailer[PACK_TRAILER_SIZE];
+    if (read_fully_at(fd, magic, PACK_MAGIC_SIZE, 0) == -1 ||
+        read_fully_at(fd, trailer, PACK_TRAILER_SIZE, pack_stat.st_size - PACK_TRAILER_SIZE) == -1 ||
+        memcmp(magic, PACK_MAGIC, PACK_MAGIC_SIZE) != 0 ||
+        memcmp(trailer + 16, PACK_INDEX_MAGIC, PACK_MAGIC_SIZE) != 0)
+        return -1;
+
+    uint64_t index_offset = get_le(trailer, 8);
+    uint64_t num_entries  = get_le(trailer + 8, 8);
+    uint64_t index_end    = pack_stat.st_size - PACK_TRAILER_SIZE;
+    if (index_offset < PACK_MAGIC_SIZE || index_offset > index_end || num_entries > index_end - index_offset)
+        return -1;
+
+    size_t index_size = index_end - index_offset;
+    uint8_t *index = malloc(index_size > 0 ? index_size : 1);
+    *entries = calloc(num_entries > 0 ? num_entries : 1, sizeof(pack_entry_t));
+    if (index == NULL || *entries == NULL || read_fully_at(fd, index, index_size, index_offset) == -1)
+    {
+        free(index);
+        free(*entries);
+        *entries = NULL;
+        return -1;
+    }
+
+    // every record has to fit in the index and point at image data before it
+    uint8_t *pos = index;
+    uint8_t *end = index + index_size;
+    int count = 0;
+    for (; count < (int)num_entries; count++)
+    {
+        if (end - pos < 2)
+            break;
+        size_t name_length = get_le(pos, 2);
+        if ((size_t)(end - pos) < 2 + name_length + 20)
+            break;
+
+        pack_entry_t *entry = &(*entries)[count];
+        entry->name = strndup((char *)pos + 2, name_length);
+        pos += 2 + name_length;
+        entry->offset = get_le(pos, 8);
+        entry->size   = get_le(pos + 8, 8);
+        entry->crc    = get_le(pos + 16, 4);
+        pos += 20;
+
+        if (entry->offset < PACK_MAGIC_SIZE || entry->offset > index_offset ||
+            entry->size > index_offset - entry->offset)
+        {
+            free(entry->name);
+            break;
+        }
+    }
+    free(index);
+
+    if (count != (int)num_entries)
+    {
+        pack_free_index(*entries, count);
+        *entries = NULL;
+        return -1;
+    }
+    return count;
+}
+
+void pack_free_index(pack_entry_t *entries, int num_entries)
+{
+    for (int i = 0; i < num_entries; i++)
+        free(entries[i].name);
+    free(entries);
+}
@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <string.h>
+#include "png_stream.h"
+
+#define PNG_CHUNK_IHDR 0x49484452
+#define PNG_CHUNK_PLTE 0x504c5445
+#define PNG_CHUNK_IDAT 0x49444154
+#define PNG_CHUNK_IEND 0x49454e44
+#define PNG_CHUNK_TRNS 0x74524e53
+#define PNG_MAX_DIMENSION (1 << 24)   // stb_image's limit, so both refuse the same images
+
+const uint8_t PNG_SIGNATURE[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+uint32_t read_be32(const uint8_t *data)
+{
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+uint8_t gray_of(int r, int g, int b)
+{
+    return (uint8_t)((r * 77 + g * 150 + b * 29) >> 8);
+}
+
+int paeth(int a, int b, int c)
+{
+    int p  = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+bool png_stream_supported(const uint8_t *data, size_t length)
+{
+    if (length < PNG_STREAM_HEADER_BYTES || memcmp(data, PNG_SIGNATURE, sizeof(PNG_SIGNATURE)) != 0 ||
+        read_be32(data + 8) != 13 || read_be32(data + 12) != PNG_CHUNK_IHDR)
+        return false;
+
+    uint32_t width  = read_be32(data + 16);
+    uint32_t height = read_be32(data + 20);
+    int depth      = data[24];
+    int color_type = data[25];
+
+    // 8-bit gray, RGB, palette, gray with alpha and RGBA; sub-byte and 16-bit samples and
+    // interlacing stay with stb_image
+    if (depth != 8 || (color_type != 0 && color_type != 2 && color_type != 3 && color_type != 4 && color_type != 6) ||
+        data[26] != 0 || data[27] != 0 || data[28] != 0)
+        return false;
+
+    return width > 0 && height > 0 && width <= PNG_MAX_DIMENSION && height <= PNG_MAX_DIMENSION &&
+           (1 << 30) / width / 4 >= height;
+}
+
+int png_stream_init(png_stream_t *png, const uint8_t *data)
+{
+    memset(png, 0, sizeof(png_stream_t));
+    png->phase = PNG_STREAM_FAILED;
+    if (!png_stream_supported(data, PNG_STREAM_HEADER_BYTES))
+        return -1;
+
+    png->width      = read_be32(data + 16);
+    png->height     = read_be32(data + 20);
+    png->color_type = data[25];
+    png->channels   = (png->color_type == 3) ? 1 : ((png->color_type & 2) ? 3 : 1) + ((png->color_type & 4) ? 1 : 0);
+    png->row_bytes  = png->width * png->channels;
+
+    png->row      = malloc(png->row_bytes + 1);
+    png->prev_row = calloc(png->row_bytes + 1, 1);
+    png->pixels   = malloc((size_t)png->width * png->height);
+    if (png->row == NULL || png->prev_row == NULL || png->pixels == NULL || inflateInit(&png->inflater) != Z_OK)
+    {
+        free(png->row);
+        free(png->prev_row);
+        free(png->pixels);
+        png->row = png->prev_row = png->pixels = NULL;
+        return -1;
+    }
+
+    png->offset = PNG_STREAM_HEADER_BYTES;
+    png->phase  = PNG_STREAM_CHUNK_HEADER;
+    return 0;
+}
+
+// undoes the filter of the row just inflated and writes it out in gray
+int finish_row(png_stream_t *png)
+{
+    uint8_t *cur  = png->row + 1;
+    uint8_t *prev = png->prev_row + 1;
+    int bpp = png->channels;
+
+    switch (png->row[0])
+    {
+        case 0:
+            break;
+        case 1:
+            for (int i = bpp; i < png->row_bytes; i++)
+                cur[i] += cur[i - bpp];
+            break;
+        case 2:
+            for (int i = 0; i < png->row_bytes; i++)
+                cur[i] += prev[i];
+            break;
+        case 3:
+            for (int i = 0; i < png->row_bytes; i++)
+                cur[i] += ((i >= bpp ? cur[i - bpp] : 0) + prev[i]) >> 1;
+            break;
+        case 4:
+            for (int i = 0; i < png->row_bytes; i++)
+                cur[i] += paeth(i >= bpp ? cur[i - bpp] : 0, prev[i], i >= bpp ? prev[i - bpp] : 0);
+            break;
+        default:
+            return -1;
+    }
+
+    uint8_t *out = png->pixels + (size_t)png->rows_done * png->width;
+    for (int x = 0; x < png->width; x++)
+    {
+        const uint8_t *pixel = cur + x * bpp;
+        if (png->color_type == 3)
+        {
+            if (pixel[0] >= png->palette_size)
+                return -1;
+            out[x] = png->palette_gray[pixel[0]];
+        }
+        else if (png->color_type & 2)
+            out[x] = gray_of(pixel[0], pixel[1], pixel[2]);
+        else
+            out[x] = pixel[0];    // any alpha is dropped
+    }
+
+    // this row is the one the next is filtered against
+    uint8_t *done = png->row;
+    png->row      = png->prev_row;
+    png->prev_row = done;
+    png->rows_done++;
+    return 0;
+}
+
+// inflates IDAT bytes into rows, finishing each row as soon as it is whole
+int inflate_input(png_stream_t *png, const uint8_t *input, size_t length)
+{
+    png->inflater.next_in  = (Bytef *)input;
+    png->inflater.avail_in = length;
+
+    while (png->inflater.avail_in > 0)
+    {
+        // data past the end of the zlib stream is left for stb_image to judge
+        if (png->inflate_done)
+            return -1;
+
+        // after the last row only the end of the zlib stream may come, so any byte of output is too many
+        uint8_t spare;
+        bool all_rows = (png->rows_done == png->height);
+        png->inflater.next_out  = all_rows ? &spare : png->row + png->row_fill;
+        png->inflater.avail_out = all_rows ? 1 : png->row_bytes + 1 - png->row_fill;
+        int status = inflate(&png->inflater, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END)
+            return -1;
+
+        png->inflate_done = (status == Z_STREAM_END);
+        if (all_rows)
+        {
+            if (png->inflater.avail_out == 0)
+                return -1;
+            continue;
+        }
+
+        png->row_fill = png->row_bytes + 1 - png->inflater.avail_out;
+        if (png->row_fill == png->row_bytes + 1)
+        {
+            png->row_fill = 0;
+            if (finish_row(png) == -1)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int png_stream_feed(png_stream_t *png, const uint8_t *data, size_t length)
+{
+    while (png->phase != PNG_STREAM_DONE && png->phase != PNG_STREAM_FAILED)
+    {
+        size_t available = length - png->offset;
+
+        if (png->phase == PNG_STREAM_CHUNK_HEADER)
+        {
+            if (available < 8)
+                return 0;
+            png->chunk_left = read_be32(data + png->offset);
+            png->chunk_type = read_be32(data + png->offset + 4);
+            png->offset += 8;
+            png->phase = PNG_STREAM_CHUNK_DATA;
+
+            bool critical = !(png->chunk_type & 0x20000000);
+            if (png->chunk_left > 0x7fffffff || png->chunk_type == PNG_CHUNK_IHDR ||
+                (png->chunk_type == PNG_CHUNK_IDAT && png->color_type == 3 && png->palette_size == 0))
+                png->phase = PNG_STREAM_FAILED;
+            else if (png->chunk_type == PNG_CHUNK_IEND)
+            {
+                // the rest of IEND does not matter
+                png->phase = (png->inflate_done && png->rows_done == png->height) ? PNG_STREAM_DONE : PNG_STREAM_FAILED;
+            }
+            // an unknown critical chunk, or a tRNS that stb_image may refuse, is its call
+            else if ((critical && png->chunk_type != PNG_CHUNK_PLTE && png->chunk_type != PNG_CHUNK_IDAT) ||
+                     png->chunk_type == PNG_CHUNK_TRNS)
+                png->phase = PNG_STREAM_FAILED;
+            continue;
+        }
+
+        if (png->phase == PNG_STREAM_CHUNK_CRC)
+        {
+            // stb_image does not check the CRC either
+            if (available < 4)
+                return 0;
+            png->offset += 4;
+            png->phase = PNG_STREAM_CHUNK_HEADER;
+            continue;
+        }
+
+        if (png->chunk_type == PNG_CHUNK_PLTE)
+        {
+            // small enough to wait for whole
+            if (available < png->chunk_left)
+                return 0;
+            if (png->chunk_left > 256 * 3 || png->chunk_left % 3 != 0)
+            {
+                png->phase = PNG_STREAM_FAILED;
+                break;
+            }
+            png->palette_size = png->chunk_left / 3;
+            for (int i = 0; i < png->palette_size; i++)
+            {
+                const uint8_t *entry = data + png->offset + i * 3;
+                png->palette_gray[i] = gray_of(entry[0], entry[1], entry[2]);
+            }
+            png->offset += png->chunk_left;
+            png->chunk_left = 0;
+            png->phase = PNG_STREAM_CHUNK_CRC;
+            continue;
+        }
+
+        // image data is inflated and anything else skipped, as far as it has arrived
+        size_t take = available < png->chunk_left ? available : png->chunk_left;
+        if (png->chunk_type == PNG_CHUNK_IDAT && take > 0 && inflate_input(png, data + png->offset, take) == -1)
+        {
+            png->phase = PNG_STREAM_FAILED;
+            break;
+        }
+        png->offset += take;
+        png->chunk_left -= take;
+        if (png->chunk_left > 0)
+            return 0;
+        png->phase = PNG_STREAM_CHUNK_CRC;
+    }
+
+    return png->phase == PNG_STREAM_FAILED ? -1 : 0;
+}
+
+bool png_stream_complete(png_stream_t *png)
+{
+    return png->phase == PNG_STREAM_DONE;
+}
+
+void png_stream_free(png_stream_t *png)
+{
+    if (png->row != NULL)
+        inflateEnd(&png->inflater);
+    free(png->row);
+    free(png->prev_row);
+    free(png->pixels);
+    png->row = png->prev_row = png->pixels = NULL;
+}
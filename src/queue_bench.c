@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "job_queue.h"
+#include "mpmc_ring.h"
+
+// handoff microbenchmark: producers push tiny work items that consumers pop right away,
+// so the time measured is almost all queue overhead
+
+#define DEFAULT_PRODUCERS 1
+#define DEFAULT_CONSUMERS 4
+#define DEFAULT_ITEMS 2000000
+#define DEFAULT_CAPACITY 64
+
+typedef struct bench
+{
+    job_queue_t queue;
+    mpmc_ring_t ring;
+    bool        use_ring;
+    long        items_per_producer;
+    long        consumed_sum;
+} bench_t;
+
+int stop_item;   // pushed once per consumer after the real items
+
+void bench_push(bench_t *bench, void *item)
+{
+    if (bench->use_ring)
+        mpmc_ring_push(&bench->ring, item);
+    else
+        job_queue_push(&bench->queue, item);
+}
+
+void *bench_pop(bench_t *bench)
+{
+    if (bench->use_ring)
+        return mpmc_ring_pop(&bench->ring);
+    return job_queue_pop(&bench->queue);
+}
+
+void *producer_routine(void *args)
+{
+    bench_t *bench = (bench_t *)args;
+    for (long i = 1; i <= bench->items_per_producer; i++)
+        bench_push(bench, (void *)(uintptr_t)i);
+    return NULL;
+}
+
+void *consumer_routine(void *args)
+{
+    bench_t *bench = (bench_t *)args;
+    long sum = 0;
+
+    void *item;
+    while ((item = bench_pop(bench)) != &stop_item)
+        sum += (long)(uintptr_t)item;
+
+    __atomic_add_fetch(&bench->consumed_sum, sum, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+double run_bench(bool use_ring, int producers, int consumers, long items, int capacity)
+{
+    bench_t bench;
+    bench.use_ring           = use_ring;
+    bench.items_per_producer = items / producers;
+    bench.consumed_sum       = 0;
+
+    if (use_ring ? mpmc_ring_init(&bench.ring, capacity) : job_queue_init(&bench.queue, capacity))
+    {
+        fprintf(stderr, "ERROR: Could not create queue\n");
+        exit(1);
+    }
+
+    pthread_t producer_threads[producers];
+    pthread_t consumer_threads[consumers];
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < consumers; i++)
+        pthread_create(&consumer_threads[i], NULL, consumer_routine, &bench);
+    for (int i = 0; i < producers; i++)
+        pthread_create(&producer_threads[i], NULL, producer_routine, &bench);
+
+    for (int i = 0; i < producers; i++)
+        pthread_join(producer_threads[i], NULL);
+    for (int i = 0; i < consumers; i++)
+        bench_push(&bench, &stop_item);
+    for (int i = 0; i < consumers; i++)
+        pthread_join(consumer_threads[i], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // every item must come out exactly once
+    long expected = producers * (bench.items_per_producer * (bench.items_per_producer + 1) / 2);
+    if (bench.consumed_sum != expected)
+    {
+        fprintf(stderr, "ERROR: %s lost or duplicated items\n", use_ring ? "mpmc ring" : "job queue");
+        exit(1);
+    }
+
+    if (use_ring)
+        mpmc_ring_destroy(&bench.ring);
+    else
+        job_queue_destroy(&bench.queue);
+
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char* argv[])
+{
+    int producers = DEFAULT_PRODUCERS;
+    int consumers = DEFAULT_CONSUMERS;
+    long items    = DEFAULT_ITEMS;
+    int capacity  = DEFAULT_CAPACITY;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:c:n:q:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'p':
+                producers = atoi(optarg);
+                break;
+            case 'c':
+                consumers = atoi(optarg);
+                break;
+            case 'n':
+                items = atol(optarg);
+                break;
+            case 'q':
+                capacity = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: ./queue_bench [-p producers] [-c consumers] [-n items] [-q capacity]\n");
+                exit(1);
+        }
+    }
+
+    if (producers < 1 || consumers < 1 || items < producers || capacity < 1)
+    {
+        fprintf(stderr, "ERROR: Producer, consumer, item and capacity counts must be positive\n");
+        exit(1);
+    }
+
+    printf("%d producers, %d consumers, %ld items, capacity %d\n", producers, consumers, items, capacity);
+    for (int i = 0; i < 2; i++)
+    {
+        bool use_ring = (i == 1);
+        double seconds = run_bench(use_ring, producers, consumers, items, capacity);
+        printf("%-24s %8.3f s %12.0f items/s %8.1f ns/item\n",
+               use_ring ? "lock-free mpmc ring" : "mutex+condvar job queue",
+               seconds, items / seconds, seconds * 1e9 / items);
+    }
+
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include "scheduler.h"
+
+int scheduler_init(scheduler_t *sched, int num_workers, int capacity)
+{
+    sched->rings = malloc(sizeof(mpmc_ring_t) * num_workers);
+    if (sched->rings == NULL)
+        return -1;
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        if (mpmc_ring_init(&sched->rings[i], capacity) == -1)
+            return -1;
+    }
+
+    sched->num_workers = num_workers;
+    sched->next_ring   = 0;
+    sched->wake_word   = 0;
+
+    return 0;
+}
+
+void scheduler_destroy(scheduler_t *sched)
+{
+    for (int i = 0; i < sched->num_workers; i++)
+        mpmc_ring_destroy(&sched->rings[i]);
+    free(sched->rings);
+    sched->rings = NULL;
+}
+
+int scheduler_submit(scheduler_t *sched, void *item, int worker)
+{
+    if (worker == -1)
+        worker = __atomic_fetch_add(&sched->next_ring, 1, __ATOMIC_RELAXED) % sched->num_workers;
+
+    // fall through to the next ring when the preferred one is full
+    int i;
+    for (i = 0; i < sched->num_workers; i++)
+    {
+        if (mpmc_ring_try_push(&sched->rings[(worker + i) % sched->num_workers], item))
+            break;
+    }
+    if (i == sched->num_workers)
+        return -1;
+
+    futex_wake_waiters(&sched->wake_word);
+
+    return 0;
+}
+
+void *scheduler_try_next(scheduler_t *sched, int worker)
+{
+    void *item = NULL;
+
+    if (worker != -1)
+        item = mpmc_ring_try_pop(&sched->rings[worker]);
+
+    // steal the oldest item of the next worker that has one
+    int start = worker != -1 ? worker : 0;
+    for (int i = 1; item == NULL && i <= sched->num_workers; i++)
+        item = mpmc_ring_try_pop(&sched->rings[(start + i) % sched->num_workers]);
+
+    return item;
+}
+
+void *scheduler_next(scheduler_t *sched, int worker)
+{
+    while (true)
+    {
+        void *item = scheduler_try_next(sched, worker);
+        if (item != NULL)
+            return item;
+
+        // announce the sleep before the last look, so a submission in between either
+        // shows up in that look or sees the sleeper and wakes it
+        uint32_t expected = futex_prepare_wait(&sched->wake_word);
+        if ((item = scheduler_try_next(sched, worker)) != NULL)
+            return item;
+        futex_wait_word(&sched->wake_word, expected);
+    }
+}
+
+int scheduler_pending(scheduler_t *sched)
+{
+    int pending = 0;
+    for (int i = 0; i < sched->num_workers; i++)
+        pending += mpmc_ring_length(&sched->rings[i]);
+    return pending;
+}
@@ -1,295 +1,2652 @@
 #include "server.h"
 
 #define PORT 8686
-#define MAX_CLIENTS 5
+#define LISTEN_BACKLOG 128
+#define DEFAULT_QUEUE_DEPTH 64
+#define DEFAULT_MAX_INFLIGHT_MB 256
+#define MIN_RETRY_MS 10
+#define MAX_RETRY_MS 10000
+#define MAX_EVENTS 64
+#define URING_ENTRIES 4096
+#define URING_CONN_SLOTS 1024
 #define BUFFER_SIZE 1024
+#define BAND_MIN_PIXELS (512 * 512)
 
-worker_thread_t worker_thread_list[MAX_CLIENTS];
+shard_t *shard_list;
+int num_shards;
+band_pool_t *band_pools;   // one per NUMA node with -N, otherwise just one
+int num_band_pools;
 
-sem_t thread_number; // allows access to the thread scheduler if any are available
+// thread placement from -I, -W, -E and -N
+cpu_list_t io_cpus, worker_cpus, encode_cpus;
+cpu_list_t numa_nodes;
+cpu_list_t *node_cpus;
+int worker_slots, encode_slots;   // threads pinned so far from -W and -E
 
-void close_thread(int worker_num, int sockfd)
+bool disk_staging;   // -d: round-trip images through temp files instead of decoding in memory
+
+char *local_socket_path = LOCAL_SOCKET_PATH;   // -u, NULL with "-u none"
+
+char *allowed_root;        // -r: IMG_OP_ROTATE_PATH may only name files beneath it, NULL turns path requests off
+int allowed_root_fd = -1;
+
+bool zerocopy_sends = true;   // -z turns off MSG_ZEROCOPY, IORING_OP_SEND_ZC and sendfile() for responses
+
+bool early_decoding = true;   // -i decodes every image only once all of it has arrived
+
+void serialize_packet(packet_t *packet, char *serialized_data)
+{
+    packet->size = htons(packet->size);
+
+    memset(serialized_data, '\0', PACKET_SIZE);
+    memcpy(serialized_data, packet, sizeof(packet_t));
+}
+
+void deserialize_data(char *serialized_data, packet_t *packet)
+{
+    memcpy(packet, serialized_data, sizeof(packet_t));
+
+    packet->size = ntohs(packet->size);
+}
+
+// bytes of the request header being received; a v1 packet is told from a v2 header once
+// PACKET_V2_SIZE bytes are in
+int header_length(connection_t *conn)
+{
+    if (conn->header_bytes < PACKET_V2_SIZE)
+        return PACKET_V2_SIZE;
+
+    packet_v2_t *header = (packet_v2_t *)conn->header;
+    if (ntohl(header->magic) != PACKET_V2_MAGIC)
+        return PACKET_SIZE;
+
+    // an oversized extension is refused by parse_header()
+    uint32_t ext_length = ntohl(header->ext_length);
+    return ext_length <= PACKET_V2_MAX_EXT ? PACKET_V2_SIZE + (int)ext_length : PACKET_V2_SIZE;
+}
+
+// decodes the received header of either version into `packet` and notes the version to answer in
+// returns 0 on success, -1 if it is malformed
+int parse_header(connection_t *conn, packet_t *packet)
+{
+    packet_v2_t *header = (packet_v2_t *)conn->header;
+    conn->raw_request = false;
+    if (ntohl(header->magic) != PACKET_V2_MAGIC)
+    {
+        conn->version    = 1;
+        conn->request_id = 0;
+        deserialize_data(conn->header, packet);
+        return 0;
+    }
+
+    conn->version    = PACKET_V2_VERSION;
+    conn->request_id = ntohl(header->request_id);
+
+    uint32_t ext_length = ntohl(header->ext_length);
+    uint64_t size = be64toh(header->size);
+    if (header->version != PACKET_V2_VERSION || ext_length > PACKET_V2_MAX_EXT ||
+        header->operation > 15 || header->flags > 15 || size > INT_MAX)
+        return -1;
+
+    // each extension must fit in the space the header gave them; types not known here are skipped
+    char *ext = conn->header + PACKET_V2_SIZE;
+    char *ext_end = ext + ext_length;
+    while (ext < ext_end)
+    {
+        packet_tlv_t tlv;
+        if (ext_end - ext < (int)sizeof(packet_tlv_t))
+            return -1;
+        memcpy(&tlv, ext, sizeof(packet_tlv_t));
+        if (ext_end - ext - (int)sizeof(packet_tlv_t) < ntohs(tlv.length))
+            return -1;
+
+        if (ntohs(tlv.type) == PACKET_TLV_RAW_IMAGE)
+        {
+            if (ntohs(tlv.length) != sizeof(packet_raw_image_t))
+                return -1;
+            memcpy(&conn->raw_image, ext + sizeof(packet_tlv_t), sizeof(packet_raw_image_t));
+            conn->raw_image.width    = ntohl(conn->raw_image.width);
+            conn->raw_image.height   = ntohl(conn->raw_image.height);
+            conn->raw_image.channels = ntohl(conn->raw_image.channels);
+            conn->raw_image.stride   = ntohl(conn->raw_image.stride);
+            conn->raw_request = true;
+        }
+        ext += sizeof(packet_tlv_t) + ntohs(tlv.length);
+    }
+
+    memset(packet, 0, sizeof(packet_t));
+    packet->operation = header->operation;
+    packet->flags     = header->flags;
+    packet->size      = size;
+    return 0;
+}
+
+void prepare_response(connection_t *conn, int operation, int size)
+{
+    // a v2 request gets a v2 header with its id, without the 1 KB of v1 padding
+    if (conn->version == PACKET_V2_VERSION)
+    {
+        packet_v2_t *header = (packet_v2_t *)conn->response;
+        memset(header, 0, sizeof(packet_v2_t));
+        header->magic      = htonl(PACKET_V2_MAGIC);
+        header->version    = PACKET_V2_VERSION;
+        header->operation  = operation;
+        header->request_id = htonl(conn->request_id);
+        header->size       = htobe64((uint64_t)size);
+
+        conn->response_size  = PACKET_V2_SIZE;
+        conn->response_bytes = 0;
+
+        // a raw result says how its pixels are laid out
+        if (operation == IMG_OP_ACK && conn->job != NULL && conn->job->raw)
+        {
+            packet_tlv_t tlv;
+            tlv.type   = htons(PACKET_TLV_RAW_IMAGE);
+            tlv.length = htons(sizeof(packet_raw_image_t));
+
+            packet_raw_image_t raw;
+            raw.width    = htonl(conn->job->width);
+            raw.height   = htonl(conn->job->height);
+            raw.channels = htonl(CHANNEL_NUM);
+            raw.stride   = htonl(conn->job->width * CHANNEL_NUM);
+
+            memcpy(conn->response + PACKET_V2_SIZE, &tlv, sizeof(packet_tlv_t));
+            memcpy(conn->response + PACKET_V2_SIZE + sizeof(packet_tlv_t), &raw, sizeof(packet_raw_image_t));
+            header->ext_length   = htonl(sizeof(packet_tlv_t) + sizeof(packet_raw_image_t));
+            conn->response_size += sizeof(packet_tlv_t) + sizeof(packet_raw_image_t);
+        }
+        return;
+    }
+
+    packet_t packet;
+    packet.operation = operation;
+    packet.flags = 0;
+    packet.size = size;
+
+    serialize_packet(&packet, conn->response);
+
+    conn->response_size  = PACKET_SIZE;
+    conn->response_bytes = 0;
+}
+
+// returns true if `shard` can take another image of `size` bytes right now
+bool admit_job(shard_t *shard, int size)
+{
+    admission_t *admission = &shard->admission;
+
+    // an idle shard always takes the request, however large it is
+    if (admission->jobs == 0)
+        return true;
+
+    return admission->jobs < admission->max_jobs &&
+           admission->bytes + size <= admission->max_bytes;
+}
+
+// estimates how long a refused client should wait before trying `shard` again
+int retry_after_ms(shard_t *shard)
+{
+    admission_t *admission = &shard->admission;
+
+    // time for the workers to get through the images already admitted
+    int ms = admission->avg_job_ms * (admission->jobs / shard->num_workers + 1);
+    if (ms < MIN_RETRY_MS)
+        ms = MIN_RETRY_MS;
+    if (ms > MAX_RETRY_MS)
+        ms = MAX_RETRY_MS;
+    return ms;
+}
+
+// true while the encoded result is being written into the job's shared memory slot
+bool result_in_slot(job_t *job)
+{
+    return job->slot != NULL && job->out_data == job->in_data;
+}
+
+// the caller points the job at its input: a receive buffer, passed files or a shared memory slot
+job_t *create_job(connection_t *conn, int angle, int size)
+{
+    admission_t *admission = &conn->loop->shard->admission;
+    admission->jobs++;
+    admission->bytes += size;
+
+    job_t *job = buffer_pool_get(&conn->loop->buffers, sizeof(job_t), NULL);
+    job->conn     = conn;
+    job->angle    = angle;
+    job->in_data  = NULL;
+    job->in_size  = size;
+    job->in_fd    = -1;
+    job->out_fd   = -1;
+    job->out_dir_fd = -1;
+    job->slot     = NULL;
+    job->out_data = NULL;
+    job->out_size = 0;
+    job->out_capacity = 0;
+    job->result_fd = -1;
+    job->zc_seq   = -1;
+    job->pixels   = NULL;
+    job->width    = 0;
+    job->height   = 0;
+    job->status   = 0;
+    job->job_ms   = 0;
+    job->next     = NULL;
+    job->name     = NULL;
+    job->finished = false;
+    job->stream_next = NULL;
+    job->request_id = 0;
+    job->path     = false;
+    job->raw      = false;
+    job->raw_channels = 0;
+    job->raw_stride   = 0;
+    job->batch        = false;
+    job->batch_count  = 0;
+    job->batch_images = NULL;
+    job->early_checked = false;
+    job->early_decode  = false;
+    job->received      = 0;
+    job->feed_kicks    = 0;
+    job->input_failed  = false;
+    job->png           = NULL;
+    job->rows_flipped  = 0;
+    job->transformed   = false;
+    return job;
+}
+
+// the hidden name a path request's result is written under beside its output, unique among live jobs
+void request_output_temp_name(job_t *job, char *dest)
+{
+    sprintf(dest, ".%s.%lx.tmp", job->name, (unsigned long)job);
+}
+
+void free_job(job_t *job)
+{
+    admission_t *admission = &job->conn->loop->shard->admission;
+    admission->jobs--;
+    admission->bytes -= job->in_size;
+
+    if (job->in_fd != -1)
+        close(job->in_fd);
+    if (job->out_fd != -1)
+        close(job->out_fd);
+    if (job->result_fd != -1)
+        close(job->result_fd);
+
+    // a path request's output that was never published is removed, leaving whatever had its name
+    if (job->out_dir_fd != -1)
+    {
+        char temp_name[NAME_MAX + 32];
+        request_output_temp_name(job, temp_name);
+        unlinkat(job->out_dir_fd, temp_name, 0);
+        close(job->out_dir_fd);
+    }
+
+    // a shared memory slot belongs to the client
+    if (job->slot != NULL)
+    {
+        if (result_in_slot(job))
+            job->out_data = NULL;
+        job->in_data = NULL;
+    }
+
+    // everything the event loop handed out goes back to its pool; the workers' pixels go to malloc
+    buffer_pool_t *buffers = &job->conn->loop->buffers;
+    buffer_pool_put(buffers, job->in_data, job->in_size);
+    buffer_pool_put(buffers, job->out_data, job->slot == NULL && job->out_capacity > 0 ? job->out_capacity : 0);
+    buffer_pool_put(buffers, job->name, job->name != NULL ? strlen(job->name) + 1 : 0);
+    free(job->pixels);
+    if (job->png != NULL)
+    {
+        png_stream_free(job->png);
+        free(job->png);
+    }
+    if (job->batch_images != NULL)
+    {
+        for (int i = 0; i < job->batch_count; i++)
+            free(job->batch_images[i].pixels);
+        free(job->batch_images);
+    }
+    buffer_pool_put(buffers, job, sizeof(job_t));
+}
+
+// gives the job a pooled output buffer about as big as its input, which the encoder grows if it must
+void reserve_output(job_t *job)
+{
+    if (job->out_fd != -1 || job->slot != NULL || disk_staging)
+        return;
+
+    size_t capacity;
+    job->out_data = buffer_pool_get(&job->conn->loop->buffers, job->in_size, &capacity);
+    job->out_capacity = job->out_data != NULL ? capacity : 0;
+}
+
+void complete_job(job_t *job, int status)
+{
+    event_loop_t *loop = job->conn->loop;
+    job->status = status;
+
+    pthread_mutex_lock(&loop->done_lock);
+    job->next = loop->done_jobs;
+    loop->done_jobs = job;
+    pthread_mutex_unlock(&loop->done_lock);
+
+    // wake the event loop so it can send the result back
+    uint64_t one = 1;
+    write(loop->wake_fd, &one, sizeof(one));
+}
+
+// hands `job` to a stage; admission keeps room for it in the stage's rings, but should that ever
+// not hold, the job fails instead of being lost with its client waiting on it
+void submit_job(scheduler_t *sched, job_t *job)
+{
+    if (scheduler_submit(sched, job, -1) == -1)
+    {
+        fprintf(stderr, "ERROR: Stage queue full, failing image\n");
+        complete_job(job, -1);
+    }
+}
+
+// sets `job` up to be decoded while it arrives, if the incremental decoder takes its image
+// returns false if it does not, or memory ran out
+bool start_early_decode(job_t *job)
+{
+    job->png = malloc(sizeof(png_stream_t));
+    if (job->png != NULL && png_stream_init(job->png, job->in_data) == 0)
+    {
+        // the flipped rows are written straight into the pixels the encoder takes
+        job->pixels = malloc((size_t)job->png->width * job->png->height);
+        if (job->pixels != NULL)
+        {
+            job->width  = job->png->width;
+            job->height = job->png->height;
+            job->early_decode = true;
+            return true;
+        }
+    }
+
+    if (job->png != NULL)
+    {
+        png_stream_free(job->png);
+        free(job->png);
+    }
+    job->png = NULL;
+    return false;
+}
+
+// wakes the decoder of `job` unless it is still running, in which case it sees the news before it parks
+void kick_early_decoder(job_t *job)
+{
+    if (__atomic_fetch_add(&job->feed_kicks, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    // the job is parked, so no worker holds it; with every ring full it waits for the next kick,
+    // unless nothing more is coming and it can only fail
+    scheduler_t *sched = &job->conn->loop->shard->stages[STAGE_DECODE].sched;
+    if (scheduler_submit(sched, job, -1) == 0)
+        return;
+    if (job->received < job->in_size && !job->input_failed)
+    {
+        __atomic_store_n(&job->feed_kicks, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    fprintf(stderr, "ERROR: Stage queue full, failing image\n");
+    complete_job(job, -1);
+}
+
+// called as the image of `job` comes in, `received` bytes so far: hands it to the decode stage as
+// soon as enough is in to tell that the incremental decoder takes it, then tells it of every read
+void feed_early_decoder(connection_t *conn, job_t *job, int received)
+{
+    if (!job->early_checked && received >= PNG_STREAM_HEADER_BYTES)
+    {
+        job->early_checked = true;
+        if (early_decoding && !disk_staging && !conn->path_request && !job->raw && !job->batch && job->in_fd == -1 && job->slot == NULL &&
+            job->in_size >= EARLY_DECODE_MIN_BYTES && start_early_decode(job))
+        {
+            conn->jobs_in_flight++;
+            reserve_output(job);
+        }
+    }
+    if (!job->early_decode)
+        return;
+
+    __atomic_store_n(&job->received, received, __ATOMIC_RELEASE);
+    kick_early_decoder(job);
+}
+
+// the upload of `job` broke off, so a decoder that already has it gives up and hands it back
+void abort_early_decode(job_t *job)
+{
+    if (job == NULL || !job->early_decode || job->received == job->in_size || job->input_failed)
+        return;
+
+    __atomic_store_n(&job->input_failed, true, __ATOMIC_RELEASE);
+    kick_early_decoder(job);
+}
+
+// an image that may be decoded as it arrives is read a chunk at a time, so the decoder hears of each
+int payload_read_size(job_t *job, int remaining)
+{
+    if (early_decoding && !disk_staging && !job->raw && !job->batch && job->in_size >= EARLY_DECODE_MIN_BYTES &&
+        (!job->early_checked || job->early_decode) && remaining > EARLY_DECODE_CHUNK)
+        return EARLY_DECODE_CHUNK;
+    return remaining;
+}
+
+// -d: the old path, staging every image through the worker's temp directory
+int decode_image_from_file(job_t *job, int worker_num)
+{
+    // create temporary (work) directory for storing temp files
+    char temp_dir_name[16];
+    memset(temp_dir_name, '\0', 16);
+    sprintf(temp_dir_name, "%d", worker_num);
+    if(mkdir(temp_dir_name, 0777) == -1 && errno != EEXIST)
+    {
+        fprintf(stderr, "ERROR: Could not create temp directory\n");
+    }
+
+    char temp_file_name[32];
+    memset(temp_file_name, '\0', 32);
+    sprintf(temp_file_name, "%d/temp.png", worker_num);
+
+    FILE *img_recv;
+    if ((img_recv = fopen(temp_file_name, "w+")) == NULL)
+    {
+        fprintf(stderr, "ERROR: Could not open output file location\n");
+        rmdir(temp_dir_name);
+        return -1;
+    }
+
+    fwrite(job->in_data, sizeof(uint8_t), job->in_size, img_recv);
+    fclose(img_recv);
+
+    int channels;
+    job->pixels = stbi_load(temp_file_name, &job->width, &job->height, &channels, CHANNEL_NUM);
+
+    if (remove(temp_file_name) != 0)
+    {
+        fprintf(stderr, "ERROR: Could not delete pre-processed temp image\n");
+    }
+
+    if (rmdir(temp_dir_name) == -1)
+    {
+        fprintf(stderr, "ERROR: Couldn't remove temp dir\n");
+        perror("rmdir");
+    }
+
+    if (job->pixels == NULL)
+    {
+        printf("Could not load image_result\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// decodes straight from the page cache of the file a local client passed in
+int decode_passed_file(job_t *job)
+{
+    uint8_t *data = mmap(NULL, job->in_size, PROT_READ, MAP_PRIVATE, job->in_fd, 0);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "ERROR: Could not map passed image\n");
+        return -1;
+    }
+
+    int channels;
+    job->pixels = stbi_load_from_memory(data, job->in_size, &job->width, &job->height, &channels, CHANNEL_NUM);
+    munmap(data, job->in_size);
+
+    if (job->pixels == NULL)
+    {
+        fprintf(stderr, "ERROR: Could not decode image\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// raw requests: the pixels only need bringing down to one gray channel, the way stb_image does it
+int unpack_raw_pixels(job_t *job)
+{
+    job->pixels = malloc((size_t)job->width * job->height);
+    if (job->pixels == NULL)
+    {
+        fprintf(stderr, "ERROR: Could not allocate raw pixels\n");
+        return -1;
+    }
+
+    for (int y = 0; y < job->height; y++)
+    {
+        const uint8_t *src = job->in_data + (size_t)y * job->raw_stride;
+        uint8_t *dst = job->pixels + (size_t)y * job->width;
+        if (job->raw_channels == 1)
+        {
+            memcpy(dst, src, job->width);
+            continue;
+        }
+        for (int x = 0; x < job->width; x++)
+        {
+            const uint8_t *pixel = src + x * job->raw_channels;
+            dst[x] = job->raw_channels < 3 ? pixel[0] : gray_of(pixel[0], pixel[1], pixel[2]);
+        }
+    }
+    return 0;
+}
+
+// batch jobs: decodes every image the batch table points at; one that cannot be decoded fails
+// only itself, a table that does not fit the payload fails the whole batch
+int decode_batch(job_t *job)
+{
+    batch_header_t header;
+    if (job->in_size < (int)sizeof(batch_header_t))
+        return -1;
+    memcpy(&header, job->in_data, sizeof(batch_header_t));
+
+    uint32_t count = ntohl(header.count);
+    uint64_t table_end = sizeof(batch_header_t) + (uint64_t)count * sizeof(batch_item_t);
+    if (count == 0 || count > MAX_BATCH_ITEMS || table_end > (uint64_t)job->in_size)
+    {
+        fprintf(stderr, "ERROR: Invalid batch table\n");
+        return -1;
+    }
+
+    job->batch_images = calloc(count, sizeof(batch_image_t));
+    if (job->batch_images == NULL)
+    {
+        fprintf(stderr, "ERROR: Could not allocate batch images\n");
+        return -1;
+    }
+    job->batch_count = count;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        batch_item_t item;
+        memcpy(&item, job->in_data + sizeof(batch_header_t) + i * sizeof(batch_item_t), sizeof(batch_item_t));
+        uint32_t offset = ntohl(item.offset);
+        uint32_t size   = ntohl(item.size);
+        if (offset < table_end || (uint64_t)offset + size > (uint64_t)job->in_size)
+            continue;
+
+        batch_image_t *image = &job->batch_images[i];
+        int channels;
+        image->pixels = stbi_load_from_memory(job->in_data + offset, size, &image->width, &image->height, &channels, CHANNEL_NUM);
+    }
+    return 0;
+}
+
+int decode_arriving_image(job_t *job, int worker_num);
+
+// decode stage: loads the received PNG as a grayscale pixel buffer
+int decode_image(job_t *job, int worker_num)
+{
+    if (job->batch)
+        return decode_batch(job);
+    if (job->raw)
+        return unpack_raw_pixels(job);
+    if (job->png != NULL)
+        return decode_arriving_image(job, worker_num);
+    if (job->in_fd != -1)
+        return decode_passed_file(job);
+    if (disk_staging)
+        return decode_image_from_file(job, worker_num);
+
+    int channels;
+    job->pixels = stbi_load_from_memory(job->in_data, job->in_size, &job->width, &job->height, &channels, CHANNEL_NUM);
+    if (job->pixels == NULL)
+    {
+        fprintf(stderr, "ERROR: Could not decode image\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// flips rows [first_row, last_row) of the image, where a row is `height` pixels as laid out by linear_to_image()
+void flip_band(void *arg, int first_row, int last_row)
+{
+    flip_args_t *flip = (flip_args_t *)arg;
+    int row_len = flip->height;
+
+    for (int i = first_row; i < last_row; i++)
+    {
+        uint8_t *dst = flip->dst + (size_t)i * row_len;
+        if (flip->angle == 270)
+        {
+            // upside down: the row comes from the mirrored position
+            memcpy(dst, flip->src + (size_t)(flip->width - 1 - i) * row_len, row_len);
+        }
+        else if (flip->angle == 180)
+        {
+            // left to right: the row is reversed in place
+            const uint8_t *src = flip->src + (size_t)i * row_len;
+            for (int j = 0; j < row_len; j++)
+                dst[j] = src[row_len - 1 - j];
+        }
+    }
+}
+
+// flips the rows of the transform whose pixels are all decoded, see flip_band()
+void flip_decoded_rows(job_t *job)
+{
+    flip_args_t flip;
+    flip.src    = job->png->pixels;
+    flip.dst    = job->pixels;
+    flip.width  = job->width;
+    flip.height = job->height;
+    flip.angle  = job->angle;
+
+    // a row here is `height` pixels of the decoded image, which comes in `width` pixels at a time
+    int ready = (long)job->png->rows_done * job->width / job->height;
+
+    // upside down, the first rows decoded are the last rows written
+    if (job->angle == 270)
+        flip_band(&flip, job->width - ready, job->width - job->rows_flipped);
+    else
+        flip_band(&flip, job->rows_flipped, ready);
+    job->rows_flipped = ready;
+}
+
+// decode stage for an image handed over while it is still arriving: decodes and flips the rows
+// that are in, then parks the job until the event loop has more; once all of it is in, an image
+// the incremental decoder gave up on is decoded again by stb_image
+int decode_arriving_image(job_t *job, int worker_num)
+{
+    while (true)
+    {
+        int kicks    = __atomic_load_n(&job->feed_kicks, __ATOMIC_ACQUIRE);
+        int received = __atomic_load_n(&job->received, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&job->input_failed, __ATOMIC_ACQUIRE))
+            return -1;
+
+        if (png_stream_feed(job->png, job->in_data, received) == 0)
+            flip_decoded_rows(job);
+
+        if (received == job->in_size)
+            break;
+
+        // nothing came in during this pass, so the event loop submits the job again once something does
+        if (__atomic_compare_exchange_n(&job->feed_kicks, &kicks, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return STAGE_PARKED;
+    }
+
+    bool complete = png_stream_complete(job->png);
+    png_stream_free(job->png);
+    free(job->png);
+    job->png = NULL;
+
+    // every row is flipped already
+    if (complete)
+    {
+        job->transformed = true;
+        return 0;
+    }
+
+    free(job->pixels);
+    job->pixels = NULL;
+    return decode_image(job, worker_num);
+}
+
+// returns a flipped copy of `pixels`, an image of `job` that is `width` by `height`
+uint8_t *flip_pixels(job_t *job, uint8_t *pixels, int width, int height)
+{
+    flip_args_t flip;
+    flip.src    = pixels;
+    flip.dst    = malloc(sizeof(uint8_t) * width * height);
+    flip.width  = width;
+    flip.height = height;
+    flip.angle  = job->angle;
+
+    // large images are split into row bands across the band pool, small ones stay on this thread
+    int num_bands = (long)width * height / BAND_MIN_PIXELS;
+    band_pool_run(job->conn->loop->shard->band_pool, flip_band, &flip, width, num_bands);
+    return flip.dst;
+}
+
+// transform stage: flips the pixels corresponding to the angle requested
+int transform_image(job_t *job, int worker_num)
+{
+    if (job->transformed)
+        return 0;
+
+    // every image of a batch is flipped on this thread, one after the other
+    for (int i = 0; i < job->batch_count; i++)
+    {
+        batch_image_t *image = &job->batch_images[i];
+        if (image->pixels == NULL)
+            continue;
+        uint8_t *flipped = flip_pixels(job, image->pixels, image->width, image->height);
+        stbi_image_free(image->pixels);
+        image->pixels = flipped;
+    }
+    if (job->batch)
+        return 0;
+
+    // the flipped pixels replace the decoded ones
+    uint8_t *flipped = flip_pixels(job, job->pixels, job->width, job->height);
+    stbi_image_free(job->pixels);
+    job->pixels = flipped;
+
+    return 0;
+}
+
+int encode_image_to_file(job_t *job, int worker_num)
+{
+    // create temporary (work) directory for storing temp files
+    char temp_dir_name[16];
+    memset(temp_dir_name, '\0', 16);
+    sprintf(temp_dir_name, "%d", worker_num);
+    if(mkdir(temp_dir_name, 0777) == -1 && errno != EEXIST)
+    {
+        fprintf(stderr, "ERROR: Could not create temp directory\n");
+    }
+
+    char new_file_name[32];
+    memset(new_file_name, '\0', 32);
+    sprintf(new_file_name, "%d/processed.png", worker_num);
+
+    // write image matrix to png
+    int written = stbi_write_png(new_file_name, job->width, job->height, CHANNEL_NUM, job->pixels, job->width * CHANNEL_NUM);
+
+    free(job->pixels);
+    job->pixels = NULL;
+
+    int processed_fd = written ? open(new_file_name, O_RDONLY) : -1;
+    struct stat processed_stat;
+    if (processed_fd == -1 || fstat(processed_fd, &processed_stat) == -1)
+    {
+        fprintf(stderr, "ERROR: Could not open processed image\n");
+        if (processed_fd != -1)
+            close(processed_fd);
+        remove(new_file_name);
+        rmdir(temp_dir_name);
+        return -1;
+    }
+
+    // get size of processed image
+    job->out_size = processed_stat.st_size;
+
+    // the epoll loop sends the file straight from the page cache, so it stays open once unlinked
+    if (zerocopy_sends && job->conn->loop->backend == BACKEND_EPOLL)
+        job->result_fd = processed_fd;
+    else
+    {
+        job->out_data = malloc(sizeof(uint8_t) * job->out_size);
+        ssize_t read_bytes = read(processed_fd, job->out_data, job->out_size);
+        job->out_size = read_bytes > 0 ? read_bytes : 0;
+
+        // memory clean up
+        close(processed_fd);
+    }
+
+    if (remove(new_file_name) != 0)
+    {
+        fprintf(stderr, "ERROR: Could not delete processed temp image\n");
+    }
+
+    if (rmdir(temp_dir_name) == -1)
+    {
+        fprintf(stderr, "ERROR: Couldn't remove temp dir\n");
+        perror("rmdir");
+    }
+
+    return 0;
+}
+
+// stbi_write_png_to_func() callback, appending to the job's growable output buffer
+void append_output(void *context, void *data, int size)
+{
+    job_t *job = (job_t *)context;
+    if (job->out_capacity == -1)
+        return;
+
+    // a result too big for its shared memory slot moves to the heap and goes back over the socket
+    if (result_in_slot(job) && job->out_size + size > job->out_capacity)
+    {
+        uint8_t *moved = malloc(job->out_size + 1);
+        if (moved == NULL)
+        {
+            job->out_capacity = -1;   // reported by encode_image() once stbi returns
+            return;
+        }
+        memcpy(moved, job->out_data, job->out_size);
+        job->out_data     = moved;
+        job->out_capacity = job->out_size;
+    }
+
+    if (job->out_size + size > job->out_capacity)
+    {
+        int capacity = job->out_capacity > 0 ? job->out_capacity : 4096;
+        while (capacity < job->out_size + size)
+            capacity *= 2;
+
+        uint8_t *grown = realloc(job->out_data, capacity);
+        if (grown == NULL)
+        {
+            job->out_capacity = -1;   // reported by encode_image() once stbi returns
+            return;
+        }
+        job->out_data     = grown;
+        job->out_capacity = capacity;
+    }
+
+    memcpy(job->out_data + job->out_size, data, size);
+    job->out_size += size;
+}
+
+// stbi_write_png_to_func() callback, writing to the file a local client passed in
+void write_passed_file(void *context, void *data, int size)
+{
+    job_t *job = (job_t *)context;
+
+    int written = 0;
+    while (job->out_capacity != -1 && written < size)
+    {
+        ssize_t new_bytes = write(job->out_fd, (uint8_t *)data + written, size - written);
+        if (new_bytes == -1 && errno == EINTR)
+            continue;
+        if (new_bytes <= 0)
+            job->out_capacity = -1;   // reported by encode_image() once stbi returns
+        else
+            written += new_bytes;
+    }
+
+    job->out_size += written;
+}
+
+// batch jobs: encodes every image into one output, behind a table of where each result is
+int encode_batch(job_t *job)
+{
+    int table_size = sizeof(batch_header_t) + job->batch_count * sizeof(batch_item_t);
+    uint8_t table[table_size];
+    memset(table, 0, table_size);
+    append_output(job, table, table_size);
+
+    batch_header_t header;
+    header.count = htonl(job->batch_count);
+    memcpy(table, &header, sizeof(batch_header_t));
+
+    for (int i = 0; i < job->batch_count; i++)
+    {
+        batch_image_t *image = &job->batch_images[i];
+        int offset  = job->out_size;
+        int written = image->pixels != NULL &&
+                      stbi_write_png_to_func(append_output, job, image->width, image->height, CHANNEL_NUM,
+                                             image->pixels, image->width * CHANNEL_NUM);
+        free(image->pixels);
+        image->pixels = NULL;
+
+        // a failed image takes up no room in the output
+        if (!written)
+            job->out_size = offset;
+
+        batch_item_t item;
+        item.status = htonl(written ? IMG_OP_ACK : IMG_OP_NAK);
+        item.offset = htonl(offset);
+        item.size   = htonl(job->out_size - offset);
+        memcpy(table + sizeof(batch_header_t) + i * sizeof(batch_item_t), &item, sizeof(batch_item_t));
+    }
+
+    if (job->out_capacity == -1)
+    {
+        fprintf(stderr, "ERROR: Could not encode processed batch\n");
+        return -1;
+    }
+    memcpy(job->out_data, table, table_size);
+    return 0;
+}
+
+// encode stage: writes the flipped pixels back out as a PNG to send to the client
+int encode_image(job_t *job, int worker_num)
+{
+    if (job->batch)
+        return encode_batch(job);
+
+    // a raw result is the flipped pixels themselves
+    if (job->raw)
+    {
+        append_output(job, job->pixels, job->width * job->height * CHANNEL_NUM);
+        free(job->pixels);
+        job->pixels = NULL;
+        if (job->out_capacity == -1)
+        {
+            fprintf(stderr, "ERROR: Could not allocate raw result\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (disk_staging && job->out_fd == -1 && job->slot == NULL)
+        return encode_image_to_file(job, worker_num);
+
+    int written = stbi_write_png_to_func(job->out_fd != -1 ? write_passed_file : append_output, job, job->width, job->height, CHANNEL_NUM,
+                                         job->pixels, job->width * CHANNEL_NUM);
+
+    free(job->pixels);
+    job->pixels = NULL;
+
+    if (!written || job->out_capacity == -1)
+    {
+        fprintf(stderr, "ERROR: Could not encode processed image\n");
+        return -1;
+    }
+
+    // a zero out_size tells the client the result follows the ACK instead
+    if (result_in_slot(job))
+        __atomic_store_n(&job->slot->out_size, job->out_size, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void *worker_routine(void *wargs)
+{
+    worker_thread_t *worker = (worker_thread_t *)wargs;
+    stage_t *stage = worker->stage;
+
+    while (true)
+    {
+        job_t *job = scheduler_next(&stage->sched, worker->index);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int status = stage->run(job, worker->worker_num);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        job->job_ms += (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+
+        // an image still arriving waits for the event loop to submit it again
+        if (status == STAGE_PARKED)
+            continue;
+        __atomic_add_fetch(&stage->processed, 1, __ATOMIC_RELAXED);
+
+        // pass the image down the pipeline, or back to the event loop after the last stage
+        if (status == -1 || stage->next == NULL)
+            complete_job(job, status);
+        else
+            submit_job(&stage->next->sched, job);
+    }
+
+    return NULL;
+}
+
+connection_t *alloc_connection(event_loop_t *loop, int sockfd)
+{
+    connection_t *conn;
+
+    // io_uring connections live in the registered slab so their packets can use fixed buffers
+    if (loop->backend == BACKEND_URING && loop->num_free_slots > 0)
+    {
+        int slot = loop->free_slots[--loop->num_free_slots];
+        conn = &loop->conn_slab[slot];
+        memset(conn, 0, sizeof(connection_t));
+        conn->slot = slot;
+    }
+    else
+    {
+        conn = malloc(sizeof(connection_t));
+        memset(conn, 0, sizeof(connection_t));
+        conn->slot = -1;
+    }
+
+    conn->sockfd = sockfd;
+    conn->loop   = loop;
+    conn->state  = CONN_READING_HEADER;
+    return conn;
+}
+
+void close_passed_fds(connection_t *conn)
+{
+    for (int i = 0; i < conn->num_passed_fds; i++)
+        close(conn->passed_fds[i]);
+    conn->num_passed_fds = 0;
+}
+
+// local clients may attach descriptors to a request packet, so their packets are read with recvmsg()
+struct msghdr *prepare_header_msg(connection_t *conn, char *dest, int remaining)
+{
+    conn->header_iov.iov_base = dest;
+    conn->header_iov.iov_len  = remaining;
+
+    memset(&conn->header_msg, 0, sizeof(struct msghdr));
+    conn->header_msg.msg_iov        = &conn->header_iov;
+    conn->header_msg.msg_iovlen     = 1;
+    conn->header_msg.msg_control    = conn->header_control;
+    conn->header_msg.msg_controllen = sizeof(conn->header_control);
+    return &conn->header_msg;
+}
+
+// keeps the descriptors that came with the last recvmsg(), closing any beyond MAX_PASSED_FDS
+void collect_passed_fds(connection_t *conn)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&conn->header_msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&conn->header_msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        int num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *fds = (int *)CMSG_DATA(cmsg);
+        for (int i = 0; i < num_fds; i++)
+        {
+            if (conn->num_passed_fds < MAX_PASSED_FDS)
+                conn->passed_fds[conn->num_passed_fds++] = fds[i];
+            else
+                close(fds[i]);
+        }
+    }
+    conn->header_msg.msg_controllen = 0;
+}
+
+// true once no zero-copy send of the job's image can still be reading it
+bool zerocopy_done(connection_t *conn, job_t *job)
+{
+    return job->zc_seq == -1 || (int32_t)((uint32_t)job->zc_seq - conn->zc_done) < 0;
+}
+
+// frees the answered jobs whose zero-copy sends have completed, or all of them with `all`
+void release_zerocopy_jobs(connection_t *conn, bool all)
+{
+    job_t **link = &conn->zc_jobs;
+    while (*link != NULL)
+    {
+        job_t *job = *link;
+        if (all || zerocopy_done(conn, job))
+        {
+            *link = job->next;
+            free_job(job);
+        }
+        else
+            link = &job->next;
+    }
+}
+
+// collects MSG_ZEROCOPY completions from the socket's error queue
+void reap_zerocopy(connection_t *conn)
+{
+    while (true)
+    {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(conn->sockfd, &msg, MSG_ERRQUEUE) == -1)
+            break;
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR)
+                continue;
+
+            // each notification covers the ids ee_info to ee_data
+            struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (err->ee_origin == SO_EE_ORIGIN_ZEROCOPY && err->ee_errno == 0 &&
+                (int32_t)(err->ee_data + 1 - conn->zc_done) > 0)
+                conn->zc_done = err->ee_data + 1;
+        }
+    }
+
+    release_zerocopy_jobs(conn, false);
+}
+
+void free_connection(connection_t *conn)
+{
+    close(conn->sockfd);
+    // the kernel holds its own references to pages it still sends from
+    release_zerocopy_jobs(conn, true);
+    close_passed_fds(conn);
+    if (conn->shm_base != NULL)
+        munmap(conn->shm_base, conn->shm_size);
+    if (conn->job != NULL)
+        free_job(conn->job);
+    if (conn->entry_job != NULL)
+        free_job(conn->entry_job);
+    while (conn->stream_head != NULL)
+    {
+        job_t *job = conn->stream_head;
+        conn->stream_head = job->stream_next;
+        free_job(job);
+    }
+
+    if (conn->slot != -1)
+        conn->loop->free_slots[conn->loop->num_free_slots++] = conn->slot;
+    else
+        free(conn);
+}
+
+void watch_connection(connection_t *conn, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = conn;
+    epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_MOD, conn->sockfd, &ev);
+}
+
+void close_connection(connection_t *conn)
+{
+    if (conn->loop->backend == BACKEND_EPOLL)
+        epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+
+    // an image decoded as it arrives will not get the rest of itself
+    abort_early_decode(conn->job);
+    abort_early_decode(conn->entry_job);
+
+    if (conn->stream_waiting)
+    {
+        connection_t **link = &conn->loop->waiting_streams;
+        while (*link != conn)
+            link = &(*link)->next_waiting;
+        *link = conn->next_waiting;
+        conn->stream_waiting = false;
+    }
+
+    // a worker still holds a job, so the connection is freed once the last one comes back
+    if (conn->jobs_in_flight > 0)
+    {
+        conn->state = CONN_CLOSING;
+        return;
+    }
+
+    free_connection(conn);
+}
+
+// returns how many bytes the current read still expects and stores where they go in `dest`
+int next_input(connection_t *conn, char **dest)
+{
+    if (conn->state == CONN_READING_HEADER)
+    {
+        *dest = conn->header + conn->header_bytes;
+        return header_length(conn) - conn->header_bytes;
+    }
+
+    if (conn->state == CONN_STREAMING && conn->stream_input == STREAM_ENTRY_HEADER && conn->multiplexed)
+    {
+        *dest = conn->header + conn->header_bytes;
+        return header_length(conn) - conn->header_bytes;
+    }
+
+    if (conn->state == CONN_STREAMING && conn->stream_input == STREAM_ENTRY_HEADER)
+    {
+        *dest = (char *)&conn->entry + conn->entry_bytes;
+        return sizeof(stream_entry_t) - conn->entry_bytes;
+    }
+
+    if (conn->state == CONN_STREAMING && conn->stream_input == STREAM_ENTRY_NAME)
+    {
+        *dest = conn->entry_job->name + conn->entry_bytes;
+        return ntohl(conn->entry.name_length) - conn->entry_bytes;
+    }
+
+    if (conn->state == CONN_STREAMING)
+    {
+        *dest = (char *)conn->entry_job->in_data + conn->payload_bytes;
+        return payload_read_size(conn->entry_job, conn->entry_job->in_size - conn->payload_bytes);
+    }
+
+    if (conn->state == CONN_DISCARDING_PAYLOAD)
+    {
+        *dest = conn->loop->discard_buffer;
+        return conn->discard_bytes < DISCARD_BUFFER_SIZE ? conn->discard_bytes : DISCARD_BUFFER_SIZE;
+    }
+
+    *dest = (char *)conn->job->in_data + conn->payload_bytes;
+    return payload_read_size(conn->job, conn->job->in_size - conn->payload_bytes);
+}
+
+// fills `iov` with the unsent part of the response and returns how many entries were used
+int next_output(connection_t *conn, struct iovec *iov)
+{
+    int iovcnt = 0;
+
+    if (conn->response_bytes < conn->response_size)
+    {
+        iov[iovcnt].iov_base = conn->response + conn->response_bytes;
+        iov[iovcnt].iov_len  = conn->response_size - conn->response_bytes;
+        iovcnt++;
+    }
+
+    // response_bytes keeps counting past the packet into the image data
+    int sent_payload = conn->response_bytes > conn->response_size ? conn->response_bytes - conn->response_size : 0;
+    // results written to a passed file or a shared memory slot are only announced, failed ones have none
+    if (conn->job != NULL && conn->job->out_fd == -1 && !result_in_slot(conn->job) &&
+        conn->job->status == 0 && sent_payload < conn->job->out_size)
+    {
+        iov[iovcnt].iov_base = conn->job->out_data + sent_payload;
+        iov[iovcnt].iov_len  = conn->job->out_size - sent_payload;
+        iovcnt++;
+    }
+
+    return iovcnt;
+}
+
+void handle_writable(connection_t *conn);
+void uring_queue_read(connection_t *conn);
+void uring_queue_write(connection_t *conn);
+void start_stream(connection_t *conn, int angle);
+void start_multiplexing(connection_t *conn, int window);
+int consume_stream_input(connection_t *conn, int new_bytes);
+int stream_progress(connection_t *conn);
+
+void start_response(connection_t *conn, int operation, int size)
+{
+    prepare_response(conn, operation, size);
+    conn->state = CONN_WRITING_RESPONSE;
+
+    if (conn->loop->backend == BACKEND_URING)
+        uring_queue_write(conn);
+    else
+        handle_writable(conn);
+}
+
+void reject_request(connection_t *conn)
+{
+    conn->close_after_write = true;
+    start_response(conn, IMG_OP_NAK, 0);
+}
+
+// maps the ring of image slots a local client shares with IMG_OP_SHM_ATTACH
+// returns 0 on success, -1 if the request was malformed
+int attach_shared_memory(connection_t *conn, int num_slots)
+{
+    struct stat shm_stat;
+    if (conn->num_passed_fds != 1 || num_slots < 1 || fstat(conn->passed_fds[0], &shm_stat) == -1)
+        return -1;
+
+    int slot_size = shm_stat.st_size / num_slots;
+    if (slot_size <= SHM_SLOT_DATA_OFFSET)
+        return -1;
+
+    uint8_t *base = mmap(NULL, shm_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, conn->passed_fds[0], 0);
+    if (base == MAP_FAILED)
+        return -1;
+    close_passed_fds(conn);
+
+    if (conn->shm_base != NULL)
+        munmap(conn->shm_base, conn->shm_size);
+    conn->shm_base      = base;
+    conn->shm_size      = shm_stat.st_size;
+    conn->shm_slot_size = slot_size;
+    conn->shm_num_slots = num_slots;
+    return 0;
+}
+
+// returns the header of slot `index` of the connection's shared memory, or NULL if there is no such slot
+shm_slot_header_t *shared_memory_slot(connection_t *conn, int index)
+{
+    if (conn->shm_base == NULL || index < 0 || index >= conn->shm_num_slots)
+        return NULL;
+    return (shm_slot_header_t *)(conn->shm_base + (size_t)index * conn->shm_slot_size);
+}
+
+// opens `path`, which must be absolute and lie beneath the -r root; symlinks and ".." may not leave it
+// returns the descriptor, or -1
+int open_beneath_root(const char *path, int flags)
+{
+    size_t root_length = strlen(allowed_root);
+    if (strncmp(path, allowed_root, root_length) != 0 ||
+        (path[root_length] != '/' && path[root_length] != '\0' && root_length > 1))
+        return -1;
+
+    const char *relative = path + root_length;
+    while (*relative == '/')
+        relative++;
+    if (*relative == '\0')
+        relative = ".";
+
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags   = flags | O_CLOEXEC;
+    how.mode    = (flags & O_CREAT) ? 0666 : 0;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    return syscall(SYS_openat2, allowed_root_fd, relative, &how, sizeof(how));
+}
+
+// IMG_OP_ROTATE_PATH: opens the files named in the received payload, which the job then reads and writes
+// like passed descriptors; returns 0 on success, -1 if a path is malformed, outside the root or missing
+int open_request_paths(job_t *job)
+{
+    job->path = true;
+    char *in_path  = (char *)job->in_data;
+    char *out_path = memchr(in_path, '\0', job->in_size);
+    if (out_path == NULL || ++out_path >= in_path + job->in_size || in_path[job->in_size - 1] != '\0')
+        return -1;
+
+    // the output's directory, and the name the result takes in it once it is complete
+    char *out_name = strrchr(out_path, '/');
+    if (out_name == NULL || out_name[1] == '\0' || strlen(out_name + 1) > NAME_MAX ||
+        strcmp(out_name + 1, ".") == 0 || strcmp(out_name + 1, "..") == 0)
+        return -1;
+    *out_name++ = '\0';
+
+    // the output is only created once the input is known to be there, under a temp name that
+    // free_job() removes unless the result is published
+    struct stat in_stat;
+    if ((job->in_fd = open_beneath_root(in_path, O_RDONLY)) == -1 ||
+        fstat(job->in_fd, &in_stat) == -1 || !S_ISREG(in_stat.st_mode) ||
+        (job->out_dir_fd = open_beneath_root(out_path[0] != '\0' ? out_path : "/", O_PATH | O_DIRECTORY)) == -1)
+        return -1;
+
+    job->name = buffer_pool_get(&job->conn->loop->buffers, strlen(out_name) + 1, NULL);
+    strcpy(job->name, out_name);
+
+    char temp_name[NAME_MAX + 32];
+    request_output_temp_name(job, temp_name);
+    job->out_fd = openat(job->out_dir_fd, temp_name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0666);
+    if (job->out_fd == -1)
+        return -1;
+
+    buffer_pool_put(&job->conn->loop->buffers, job->in_data, job->in_size);
+    job->in_data = NULL;
+
+    // admission was charged for the paths, from here on it holds the image
+    admission_t *admission = &job->conn->loop->shard->admission;
+    admission->bytes += in_stat.st_size - job->in_size;
+    job->in_size = in_stat.st_size;
+    return 0;
+}
+
+// checks the raw image a request describes against its operation and payload size
+// returns 0 if it is usable, -1 otherwise
+int check_raw_image(connection_t *conn, int operation, int size)
+{
+    packet_raw_image_t *raw = &conn->raw_image;
+    if (operation != IMG_OP_ROTATE || raw->width == 0 || raw->height == 0 || raw->channels < 1 || raw->channels > 4 ||
+        raw->stride < (uint64_t)raw->width * raw->channels || (uint64_t)raw->stride * raw->height != (uint64_t)size)
+        return -1;
+    return 0;
+}
+
+// a raw request's job takes the layout of its pixels from the request
+void apply_raw_image(connection_t *conn, job_t *job)
+{
+    if (!conn->raw_request)
+        return;
+
+    job->raw          = true;
+    job->width        = conn->raw_image.width;
+    job->height       = conn->raw_image.height;
+    job->raw_channels = conn->raw_image.channels;
+    job->raw_stride   = conn->raw_image.stride;
+}
+
+// the angle a request's flags ask for, or 0 if they ask for none or both
+int packet_rotation(packet_t *packet)
+{
+    if (packet->flags == (packet->flags & IMG_FLAG_ROTATE_180))
+        return 180;
+    if (packet->flags == (packet->flags & IMG_FLAG_ROTATE_270))
+        return 270;
+    return 0;
+}
+
+// returns -1 if the connection stops reading requests (it may already be closed)
+int handle_header(connection_t *conn)
+{
+    // extract data from packet
+    packet_t recv_packet;
+    int parsed = parse_header(conn, &recv_packet);
+    conn->header_bytes = 0;
+
+    if (parsed == -1)
+    {
+        fprintf(stderr, "ERROR: Invalid request, malformed v2 header\n");
+        close_passed_fds(conn);
+        reject_request(conn);
+        return -1;
+    }
+
+    if (recv_packet.operation == IMG_OP_EXIT)
+    {
+        close_connection(conn);
+        return -1;
+    }
+
+    int operation = recv_packet.operation;
+    int size = recv_packet.size;
+
+    if (conn->raw_request && check_raw_image(conn, operation, size) == -1)
+    {
+        fprintf(stderr, "ERROR: Invalid request, bad raw image description\n");
+        close_passed_fds(conn);
+        reject_request(conn);
+        return -1;
+    }
+
+    if (operation == IMG_OP_SHM_ATTACH)
+    {
+        if (attach_shared_memory(conn, size) == -1)
+        {
+            fprintf(stderr, "ERROR: Invalid request, could not map shared memory\n");
+            close_passed_fds(conn);
+            reject_request(conn);
+            return -1;
+        }
+        start_response(conn, IMG_OP_ACK, 0);
+        return -1;
+    }
+
+    // request ids only come with v2 headers
+    if (operation == IMG_OP_MULTIPLEX)
+    {
+        close_passed_fds(conn);
+        if (conn->version != PACKET_V2_VERSION)
+        {
+            fprintf(stderr, "ERROR: Invalid request, multiplexing needs v2 headers\n");
+            reject_request(conn);
+            return -1;
+        }
+        start_multiplexing(conn, size);
+        return -1;
+    }
+
+    int rotation = packet_rotation(&recv_packet);
+    if (rotation == 0)
+    {
+        fprintf(stderr, "ERROR: Invalid request\n");
+        close_passed_fds(conn);
+        reject_request(conn);
+        return -1;
+    }
+
+    if (operation == IMG_OP_STREAM)
+    {
+        close_passed_fds(conn);
+        start_stream(conn, rotation);
+        return -1;
+    }
+
+    // a batch answer may be far larger than v1 can describe
+    if (operation == IMG_OP_BATCH && conn->version != PACKET_V2_VERSION)
+    {
+        fprintf(stderr, "ERROR: Invalid request, batches need v2 headers\n");
+        close_passed_fds(conn);
+        reject_request(conn);
+        return -1;
+    }
+
+    if (operation == IMG_OP_ROTATE_PATH && (allowed_root == NULL || size < 4 || size > 2 * PATH_MAX))
+    {
+        fprintf(stderr, "ERROR: Invalid request, path requests need -r and two paths\n");
+        close_passed_fds(conn);
+        reject_request(conn);
+        return -1;
+    }
+    conn->path_request = (operation == IMG_OP_ROTATE_PATH);
+
+    // the image of a descriptor request stays in the client's file, only its size matters here
+    struct stat in_stat;
+    if (operation == IMG_OP_ROTATE_FD && (conn->num_passed_fds != 2 || fstat(conn->passed_fds[0], &in_stat) == -1))
+    {
+        fprintf(stderr, "ERROR: Invalid request, expected an input and an output descriptor\n");
+        close_passed_fds(conn);
+        reject_request(conn);
+        return -1;
+    }
+    if (operation == IMG_OP_ROTATE_FD)
+        size = in_stat.st_size;
+    else
+        close_passed_fds(conn);
+
+    // a shared memory request names the slot its image is already in
+    shm_slot_header_t *slot = NULL;
+    int slot_capacity = 0;
+    if (operation == IMG_OP_ROTATE_SHM)
+    {
+        slot = shared_memory_slot(conn, size);
+        slot_capacity = conn->shm_slot_size - SHM_SLOT_DATA_OFFSET;
+        if (slot == NULL || slot->in_size > (uint32_t)slot_capacity)
+        {
+            fprintf(stderr, "ERROR: Invalid request, no such shared memory slot\n");
+            reject_request(conn);
+            return -1;
+        }
+        size = slot->in_size;
+    }
+
+    // over the limit: skip the image the client is already sending, then tell it to back off
+    if (!admit_job(conn->loop->shard, size))
+    {
+        close_passed_fds(conn);
+        conn->discard_bytes = (operation == IMG_OP_ROTATE_FD || operation == IMG_OP_ROTATE_SHM) ? 0 : size;
+        conn->state = CONN_DISCARDING_PAYLOAD;
+        return 0;
+    }
+
+    conn->job = create_job(conn, rotation, size);
+    conn->job->batch = (operation == IMG_OP_BATCH);
+    apply_raw_image(conn, conn->job);
+    if (operation == IMG_OP_ROTATE_FD)
+    {
+        // the job owns the descriptors from here on, and there is no payload to receive
+        conn->job->in_fd  = conn->passed_fds[0];
+        conn->job->out_fd = conn->passed_fds[1];
+        conn->num_passed_fds = 0;
+        conn->payload_bytes = size;
+    }
+    else if (slot != NULL)
+    {
+        // decoded in place, then the result is encoded over the input in the same slot if it fits
+        conn->job->slot         = slot;
+        conn->job->in_data      = (uint8_t *)slot + SHM_SLOT_DATA_OFFSET;
+        conn->job->out_data     = conn->job->in_data;
+        conn->job->out_capacity = slot_capacity;
+        conn->payload_bytes = size;
+    }
+    else
+    {
+        conn->job->in_data = buffer_pool_get(&conn->loop->buffers, size, NULL);
+        conn->payload_bytes = 0;
+    }
+    conn->state = CONN_READING_PAYLOAD;
+    return 0;
+}
+
+// records `new_bytes` of received data
+// returns -1 once the connection stops reading (closed, rejected, or waiting on a worker)
+int consume_input(connection_t *conn, int new_bytes)
+{
+    if (conn->state == CONN_STREAMING)
+        return consume_stream_input(conn, new_bytes);
+
+    if (conn->state == CONN_READING_HEADER)
+    {
+        if (conn->local)
+            collect_passed_fds(conn);
+
+        conn->header_bytes += new_bytes;
+        if (conn->header_bytes == header_length(conn))
+            return handle_header(conn);
+        return 0;
+    }
+
+    if (conn->state == CONN_DISCARDING_PAYLOAD)
+    {
+        conn->discard_bytes -= new_bytes;
+        if (conn->discard_bytes > 0)
+            return 0;
+
+        start_response(conn, IMG_OP_BUSY, retry_after_ms(conn->loop->shard));
+        return -1;
+    }
+
+    conn->payload_bytes += new_bytes;
+    if (conn->payload_bytes < conn->job->in_size)
+    {
+        feed_early_decoder(conn, conn->job, conn->payload_bytes);
+        return 0;
+    }
+
+    // a file that cannot be opened fails only its own request
+    if (conn->path_request)
+    {
+        conn->path_request = false;
+        if (open_request_paths(conn->job) == -1)
+        {
+            fprintf(stderr, "ERROR: Could not open the files of a path request\n");
+            free_job(conn->job);
+            conn->job = NULL;
+            start_response(conn, IMG_OP_NAK, 0);
+            return -1;
+        }
+    }
+
+    // hand the image to the worker pool; the socket stays quiet until it is done
+    conn->state = CONN_WAITING_COMPUTE;
+    if (conn->loop->backend == BACKEND_EPOLL)
+        watch_connection(conn, 0);
+
+    // an image the decoder already has only needs to hear that the rest is in
+    if (conn->job->early_decode)
+    {
+        feed_early_decoder(conn, conn->job, conn->payload_bytes);
+        return -1;
+    }
+    conn->jobs_in_flight++;
+    reserve_output(conn->job);
+    submit_job(&conn->loop->shard->stages[STAGE_DECODE].sched, conn->job);
+    return -1;
+}
+
+// frees the job whose result just went out
+void release_sent_job(connection_t *conn)
+{
+    // an image the kernel may still be reading is freed once its zero-copy send completes
+    if (zerocopy_done(conn, conn->job))
+        free_job(conn->job);
+    else
+    {
+        conn->job->next = conn->zc_jobs;
+        conn->zc_jobs   = conn->job;
+    }
+    conn->job = NULL;
+}
+
+// called once the whole response is out
+// returns -1 if the connection was closed, 0 if it is ready for the next request
+int finish_response(connection_t *conn)
+{
+    if (conn->job != NULL)
+        release_sent_job(conn);
+
+    if (conn->close_after_write)
+    {
+        close_connection(conn);
+        return -1;
+    }
+
+    conn->state = CONN_READING_HEADER;
+    return 0;
+}
+
+/********************* [ epoll backend ] ************************/
+
+void handle_readable(connection_t *conn)
+{
+    while (true)
+    {
+        char *dest;
+        int remaining = next_input(conn, &dest);
+
+        int new_bytes = 0;
+        if (remaining > 0)
+        {
+            if (conn->local && conn->state == CONN_READING_HEADER)
+                new_bytes = recvmsg(conn->sockfd, prepare_header_msg(conn, dest, remaining), MSG_CMSG_CLOEXEC);
+            else
+                new_bytes = read(conn->sockfd, dest, remaining);
+            if (new_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (new_bytes == -1 && errno == EINTR)
+                continue;
+            if (new_bytes <= 0)
+            {
+                // client went away without sending IMG_OP_EXIT
+                close_connection(conn);
+                return;
+            }
+        }
+
+        if (consume_input(conn, new_bytes) == -1)
+            return;
+    }
+}
+
+// sends what next_output() found: an image in a -d file goes out with sendfile() and a large one
+// with MSG_ZEROCOPY once the packet is out, anything else with a single writev()
+ssize_t send_output(connection_t *conn, struct iovec *iov, int iovcnt)
+{
+    job_t *job = conn->job;
+    if (job == NULL || (job->result_fd == -1 && !(conn->zerocopy && job->out_size >= ZEROCOPY_MIN_BYTES)))
+        return writev(conn->sockfd, iov, iovcnt);
+
+    if (conn->response_bytes < conn->response_size)
+        return write(conn->sockfd, iov[0].iov_base, iov[0].iov_len);
+
+    if (job->result_fd != -1)
+    {
+        off_t offset = conn->response_bytes - conn->response_size;
+        return sendfile(conn->sockfd, job->result_fd, &offset, iov[0].iov_len);
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = 1;
+
+    ssize_t sent = sendmsg(conn->sockfd, &msg, MSG_ZEROCOPY);
+    if (sent > 0)
+        job->zc_seq = conn->zc_sent++;
+    // out of memory to pin pages with, copy this part instead
+    else if (sent == -1 && errno == ENOBUFS)
+        sent = write(conn->sockfd, iov[0].iov_base, iov[0].iov_len);
+    return sent;
+}
+
+void handle_writable(connection_t *conn)
+{
+    while (true)
+    {
+        struct iovec iov[2];
+        int iovcnt = next_output(conn, iov);
+        if (iovcnt == 0)
+            break;
+
+        ssize_t new_bytes = send_output(conn, iov, iovcnt);
+        if (new_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            watch_connection(conn, EPOLLOUT);
+            return;
+        }
+        if (new_bytes == -1 && errno == EINTR)
+            continue;
+        if (new_bytes <= 0)
+        {
+            fprintf(stderr, "ERROR: Could not send response\n");
+            close_connection(conn);
+            return;
+        }
+
+        conn->response_bytes += new_bytes;
+    }
+
+    // the whole response is out, wait for the next request
+    if (finish_response(conn) == 0)
+        watch_connection(conn, EPOLLIN);
+}
+
+// IMG_OP_STREAM: images arrive back to back behind stream entry headers and go to the workers as
+// soon as each is in, while the results of earlier ones go back in the same order
+// IMG_OP_MULTIPLEX runs on the same machinery, but each image comes as a v2 request and its reply
+// goes back under the request's id as soon as it is done, in whatever order they finish
+
+bool stream_wants_input(connection_t *conn)
+{
+    return conn->stream_input != STREAM_INPUT_DONE && conn->stream_jobs < conn->stream_window &&
+           !conn->stream_waiting;
+}
+
+void start_stream(connection_t *conn, int angle)
+{
+    conn->state           = CONN_STREAMING;
+    conn->multiplexed     = false;
+    conn->stream_window   = STREAM_WINDOW;
+    conn->stream_angle    = angle;
+    conn->stream_input    = STREAM_ENTRY_HEADER;
+    conn->entry_bytes     = 0;
+    conn->stream_end_sent = false;
+    conn->response_size   = 0;
+    conn->response_bytes  = 0;
+    stream_progress(conn);
+}
+
+// the ACK grants the client a window of requests, which the connection serves until IMG_OP_EXIT
+void start_multiplexing(connection_t *conn, int window)
+{
+    conn->state           = CONN_STREAMING;
+    conn->multiplexed     = true;
+    conn->stream_window   = window < 1 ? 1 : (window > MULTIPLEX_WINDOW ? MULTIPLEX_WINDOW : window);
+    conn->stream_input    = STREAM_ENTRY_HEADER;
+    conn->stream_end_sent = false;
+    prepare_response(conn, IMG_OP_ACK, conn->stream_window);
+    stream_progress(conn);
+}
+
+// the client broke the stream format, or a send failed
+void abort_stream(connection_t *conn)
+{
+    // io_uring: whatever is still queued completes once the socket is shut down, then it is closed
+    if (conn->loop->backend == BACKEND_URING && conn->pending_ops > 0)
+    {
+        conn->io_error = true;
+        shutdown(conn->sockfd, SHUT_RDWR);
+        return;
+    }
+    close_connection(conn);
+}
+
+// records `new_bytes` of the next request of a multiplexed connection; returns -1 if the connection was closed
+int consume_multiplexed_header(connection_t *conn, int new_bytes)
+{
+    shard_t *shard = conn->loop->shard;
+
+    conn->header_bytes += new_bytes;
+    bool is_v2 = conn->header_bytes < PACKET_V2_SIZE ||
+                 ntohl(((packet_v2_t *)conn->header)->magic) == PACKET_V2_MAGIC;
+    if (is_v2 && conn->header_bytes < header_length(conn))
+        return 0;
+
+    packet_t packet;
+    if (!is_v2 || parse_header(conn, &packet) == -1)
+    {
+        fprintf(stderr, "ERROR: Invalid multiplexed request, malformed v2 header\n");
+        abort_stream(conn);
+        return -1;
+    }
+
+    if (packet.operation == IMG_OP_EXIT)
+    {
+        // the connection closes once every reply is out
+        conn->header_bytes = 0;
+        conn->stream_input = STREAM_INPUT_DONE;
+        return 0;
+    }
+
+    int rotation = packet_rotation(&packet);
+    if (packet.operation != IMG_OP_ROTATE || rotation == 0 ||
+        (conn->raw_request && check_raw_image(conn, packet.operation, packet.size) == -1))
+    {
+        fprintf(stderr, "ERROR: Invalid multiplexed request\n");
+        abort_stream(conn);
+        return -1;
+    }
+
+    // over the limit: hold the header until finished images make room
+    if (!admit_job(shard, packet.size))
+    {
+        conn->stream_waiting = true;
+        conn->next_waiting   = conn->loop->waiting_streams;
+        conn->loop->waiting_streams = conn;
+        return 0;
+    }
+
+    conn->entry_job = create_job(conn, rotation, packet.size);
+    conn->entry_job->in_data    = buffer_pool_get(&conn->loop->buffers, packet.size, NULL);
+    conn->entry_job->request_id = conn->request_id;
+    apply_raw_image(conn, conn->entry_job);
+    conn->header_bytes  = 0;
+    conn->payload_bytes = 0;
+    conn->stream_input  = STREAM_ENTRY_PAYLOAD;
+    return 0;
+}
+
+// records `new_bytes` of a stream entry; returns -1 if the connection was closed
+int consume_stream_input(connection_t *conn, int new_bytes)
+{
+    shard_t *shard = conn->loop->shard;
+
+    if (conn->stream_input == STREAM_ENTRY_HEADER && conn->multiplexed)
+        return consume_multiplexed_header(conn, new_bytes);
+
+    if (conn->stream_input == STREAM_ENTRY_HEADER)
+    {
+        conn->entry_bytes += new_bytes;
+        if (conn->entry_bytes < (int)sizeof(stream_entry_t))
+            return 0;
+
+        uint32_t name_length = ntohl(conn->entry.name_length);
+        uint32_t size        = ntohl(conn->entry.size);
+        if (name_length == 0)
+        {
+            // the stream is over once every result is back
+            conn->stream_input = STREAM_INPUT_DONE;
+            return 0;
+        }
+        if (name_length > NAME_MAX || size > INT_MAX)
+        {
+            fprintf(stderr, "ERROR: Invalid stream entry\n");
+            abort_stream(conn);
+            return -1;
+        }
+
+        // over the limit: hold the header until finished images make room
+        if (!admit_job(shard, size))
+        {
+            conn->stream_waiting = true;
+            conn->next_waiting   = conn->loop->waiting_streams;
+            conn->loop->waiting_streams = conn;
+            return 0;
+        }
+
+        conn->entry_job = create_job(conn, conn->stream_angle, size);
+        conn->entry_job->in_data = buffer_pool_get(&conn->loop->buffers, size, NULL);
+        conn->entry_job->name    = buffer_pool_get(&conn->loop->buffers, name_length + 1, NULL);
+        conn->entry_job->name[name_length] = '\0';
+        conn->entry_bytes   = 0;
+        conn->payload_bytes = 0;
+        conn->stream_input  = STREAM_ENTRY_NAME;
+        return 0;
+    }
+
+    if (conn->stream_input == STREAM_ENTRY_NAME)
+    {
+        conn->entry_bytes += new_bytes;
+        if (conn->entry_bytes == (int)ntohl(conn->entry.name_length))
+            conn->stream_input = STREAM_ENTRY_PAYLOAD;
+        return 0;
+    }
+
+    conn->payload_bytes += new_bytes;
+    if (conn->payload_bytes < conn->entry_job->in_size)
+    {
+        feed_early_decoder(conn, conn->entry_job, conn->payload_bytes);
+        return 0;
+    }
+
+    // the image goes to the workers while the next one is still arriving
+    job_t *job = conn->entry_job;
+    conn->entry_job = NULL;
+    if (conn->stream_tail != NULL)
+        conn->stream_tail->stream_next = job;
+    else
+        conn->stream_head = job;
+    conn->stream_tail = job;
+    conn->stream_jobs++;
+    if (job->early_decode)
+        feed_early_decoder(conn, job, conn->payload_bytes);
+    else
+    {
+        conn->jobs_in_flight++;
+        reserve_output(job);
+        submit_job(&shard->stages[STAGE_DECODE].sched, job);
+    }
+
+    conn->entry_bytes  = 0;
+    conn->stream_input = STREAM_ENTRY_HEADER;
+    return 0;
+}
+
+// epoll: reads stream entries until the socket runs dry or the stream stops wanting input
+// returns -1 if the connection was closed
+int stream_receive(connection_t *conn)
+{
+    while (stream_wants_input(conn))
+    {
+        char *dest;
+        int remaining = next_input(conn, &dest);
+
+        int new_bytes = 0;
+        if (remaining > 0)
+        {
+            new_bytes = read(conn->sockfd, dest, remaining);
+            if (new_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+            if (new_bytes == -1 && errno == EINTR)
+                continue;
+            if (new_bytes <= 0)
+            {
+                close_connection(conn);
+                return -1;
+            }
+        }
+
+        if (consume_stream_input(conn, new_bytes) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+// puts the reply to the first finished request of a multiplexed connection in `response`,
+// wherever it is in the list; returns false if none is finished
+bool multiplexed_next_result(connection_t *conn)
+{
+    job_t *prev = NULL;
+    job_t *job = conn->stream_head;
+    while (job != NULL && !job->finished)
+    {
+        prev = job;
+        job  = job->stream_next;
+    }
+    if (job == NULL)
+        return false;
+
+    if (prev != NULL)
+        prev->stream_next = job->stream_next;
+    else
+        conn->stream_head = job->stream_next;
+    if (conn->stream_tail == job)
+        conn->stream_tail = prev;
+    conn->job = job;
+
+    if (job->status != 0)
+        fprintf(stderr, "ERROR: could not process image\n");
+
+    conn->request_id = job->request_id;
+    prepare_response(conn, job->status == 0 ? IMG_OP_ACK : IMG_OP_NAK, job->status == 0 ? job->out_size : 0);
+    return true;
+}
+
+// puts the oldest result in `response` if a worker is done with it, or the empty entry once
+// every result is out; returns false if there is nothing to send yet
+bool stream_next_result(connection_t *conn)
+{
+    if (conn->multiplexed)
+        return multiplexed_next_result(conn);
+
+    stream_entry_t *entry = (stream_entry_t *)conn->response;
+    job_t *job = conn->stream_head;
+
+    if (job != NULL && job->finished)
+    {
+        conn->stream_head = job->stream_next;
+        if (conn->stream_head == NULL)
+            conn->stream_tail = NULL;
+        conn->job = job;
+
+        if (job->status != 0)
+            fprintf(stderr, "ERROR: could not process image\n");
+
+        int name_length = strlen(job->name);
+        entry->name_length = htonl(name_length);
+        entry->size        = htonl(job->status == 0 ? job->out_size : 0);
+        entry->status      = htonl(job->status == 0 ? IMG_OP_ACK : IMG_OP_NAK);
+        memcpy(conn->response + sizeof(stream_entry_t), job->name, name_length);
+        conn->response_size  = sizeof(stream_entry_t) + name_length;
+        conn->response_bytes = 0;
+        return true;
+    }
+
+    if (job == NULL && conn->stream_input == STREAM_INPUT_DONE && !conn->stream_end_sent)
+    {
+        memset(entry, 0, sizeof(stream_entry_t));
+        entry->status = htonl(IMG_OP_ACK);
+        conn->response_size   = sizeof(stream_entry_t);
+        conn->response_bytes  = 0;
+        conn->stream_end_sent = true;
+        return true;
+    }
+
+    return false;
+}
+
+// called once the current result is out; returns 1 if it was the empty entry that ends the stream
+int stream_result_sent(connection_t *conn)
+{
+    bool end_of_stream = (conn->job == NULL && conn->stream_end_sent && conn->response_size > 0);
+
+    if (conn->job != NULL)
+    {
+        release_sent_job(conn);
+        conn->stream_jobs--;
+    }
+    conn->response_size  = 0;
+    conn->response_bytes = 0;
+
+    if (!end_of_stream)
+        return 0;
+
+    // back to single requests
+    conn->state = CONN_READING_HEADER;
+    if (conn->loop->backend == BACKEND_URING)
+        uring_queue_read(conn);
+    else
+        watch_connection(conn, EPOLLIN);
+    return 1;
+}
+
+// sends finished results in stream order until one has to wait; returns -1 if the connection was closed
+int stream_send(connection_t *conn)
+{
+    // a send is already under way
+    if (conn->write_blocked || conn->write_ops > 0)
+        return 0;
+
+    while (true)
+    {
+        struct iovec iov[2];
+        int iovcnt = next_output(conn, iov);
+        if (iovcnt == 0)
+        {
+            if (stream_result_sent(conn) == 1 || !stream_next_result(conn))
+                return 0;
+            continue;
+        }
+
+        if (conn->loop->backend == BACKEND_URING)
+        {
+            conn->write_ops = iovcnt;
+            uring_queue_write(conn);
+            return 0;
+        }
+
+        ssize_t new_bytes = send_output(conn, iov, iovcnt);
+        if (new_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            conn->write_blocked = true;
+            return 0;
+        }
+        if (new_bytes == -1 && errno == EINTR)
+            continue;
+        if (new_bytes <= 0)
+        {
+            fprintf(stderr, "ERROR: Could not send response\n");
+            abort_stream(conn);
+            return -1;
+        }
+
+        conn->response_bytes += new_bytes;
+    }
+}
+
+// moves a stream along after any event on it; returns -1 if the connection was closed
+int stream_progress(connection_t *conn)
+{
+    bool uring = (conn->loop->backend == BACKEND_URING);
+
+    if (!uring && stream_receive(conn) == -1)
+        return -1;
+    if (stream_send(conn) == -1)
+        return -1;
+    if (conn->state != CONN_STREAMING)
+        return 0;
+
+    // a multiplexed connection ends after IMG_OP_EXIT, once the last reply is out
+    if (conn->multiplexed && conn->stream_input == STREAM_INPUT_DONE && conn->stream_jobs == 0 &&
+        conn->response_size == 0 && conn->pending_ops == 0)
+    {
+        close_connection(conn);
+        return -1;
+    }
+
+    // io_uring keeps one receive queued while the stream wants input, epoll watches for it
+    if (uring)
+    {
+        if (stream_wants_input(conn) && !conn->read_pending)
+            uring_queue_read(conn);
+    }
+    else
+        watch_connection(conn, (stream_wants_input(conn) ? EPOLLIN : 0) | (conn->write_blocked ? EPOLLOUT : 0));
+    return 0;
+}
+
+// images were freed, so streams held back by admission control may go on
+void resume_waiting_streams(event_loop_t *loop)
+{
+    connection_t *conn = loop->waiting_streams;
+    loop->waiting_streams = NULL;
+
+    while (conn != NULL)
+    {
+        connection_t *next = conn->next_waiting;
+        conn->stream_waiting = false;
+        stream_progress(conn);
+        conn = next;
+    }
+}
+
+void accept_connections(event_loop_t *loop, int listen_fd)
+{
+    while (true)
+    {
+        struct sockaddr_in clientaddr;
+        socklen_t clientaddr_len = sizeof(clientaddr);
+        int conn_fd = accept(listen_fd, (struct sockaddr *) &clientaddr, &clientaddr_len); // accept a request from a client
+        if (conn_fd == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                fprintf(stderr, "ERROR: Accepting error\n");
+            return;
+        }
+
+        fcntl(conn_fd, F_SETFL, fcntl(conn_fd, F_GETFL) | O_NONBLOCK);
+
+        connection_t *conn = alloc_connection(loop, conn_fd);
+        conn->local = (listen_fd == loop->local_fd);
+
+        // unix sockets have no zero-copy send
+        int one = 1;
+        conn->zerocopy = zerocopy_sends && !conn->local &&
+                         setsockopt(conn_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev) == -1)
+        {
+            fprintf(stderr, "ERROR: Could not watch connection\n");
+            free_connection(conn);
+        }
+    }
+}
+
+// gives a path request's finished result its output's name
+// returns 0 on success, -1 on failure
+int publish_request_output(job_t *job)
+{
+    char temp_name[NAME_MAX + 32];
+    request_output_temp_name(job, temp_name);
+    if (renameat(job->out_dir_fd, temp_name, job->out_dir_fd, job->name) == -1)
+    {
+        fprintf(stderr, "ERROR: Could not rename the result of a path request into place\n");
+        return -1;
+    }
+
+    close(job->out_dir_fd);
+    job->out_dir_fd = -1;
+    return 0;
+}
+
+void collect_finished_jobs(event_loop_t *loop)
+{
+    pthread_mutex_lock(&loop->done_lock);
+    job_t *job = loop->done_jobs;
+    loop->done_jobs = NULL;
+    pthread_mutex_unlock(&loop->done_lock);
+
+    admission_t *admission = &loop->shard->admission;
+
+    while (job != NULL)
+    {
+        job_t *next = job->next;
+        connection_t *conn = job->conn;
+
+        admission->avg_job_ms = admission->avg_job_ms * 7 / 8 + job->job_ms / 8;
+        conn->jobs_in_flight--;
+
+        if (conn->state == CONN_CLOSING)
+        {
+            // the client disconnected while its images were being processed
+            if (conn->jobs_in_flight == 0)
+                free_connection(conn);
+        }
+        else if (conn->state == CONN_STREAMING)
+        {
+            // stream results go back in order, so this one may have to wait for older ones
+            job->finished = true;
+            stream_progress(conn);
+        }
+        else if (job->status == -1 || (job->out_dir_fd != -1 && publish_request_output(job) == -1))
+        {
+            // the files of a path request may just be bad, so only that request fails
+            bool path = job->path;
+            fprintf(stderr, "ERROR: could not process image\n");
+            free_job(job);
+            conn->job = NULL;
+            if (path)
+                start_response(conn, IMG_OP_NAK, 0);
+            else
+                reject_request(conn);
+        }
+        else
+        {
+            start_response(conn, IMG_OP_ACK, job->out_size);
+        }
+
+        job = next;
+    }
+}
+
+void run_epoll_loop(event_loop_t *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    while (true)
+    {
+        int num_events = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        if (num_events == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "ERROR: epoll_wait failed\n");
+            exit(1);
+        }
+
+        for (int i = 0; i < num_events; i++)
+        {
+            if (events[i].data.ptr == &loop->listen_fd || events[i].data.ptr == &loop->local_fd)
+            {
+                accept_connections(loop, *(int *)events[i].data.ptr);
+                continue;
+            }
+            if (events[i].data.ptr == &loop->wake_fd)
+            {
+                read(loop->wake_fd, &loop->wake_count, sizeof(loop->wake_count));
+                collect_finished_jobs(loop);
+                continue;
+            }
+
+            connection_t *conn = events[i].data.ptr;
+            // zero-copy completions are reported as EPOLLERR on a healthy socket
+            if ((events[i].events & EPOLLERR) && conn->zc_sent != 0)
+            {
+                reap_zerocopy(conn);
+                events[i].events &= ~EPOLLERR;
+            }
+
+            if (conn->state == CONN_WAITING_COMPUTE)
+            {
+                if (events[i].events & (EPOLLHUP | EPOLLERR))
+                    close_connection(conn);
+            }
+            else if (conn->state == CONN_STREAMING)
+            {
+                if (events[i].events & EPOLLHUP)
+                {
+                    close_connection(conn);
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT)
+                    conn->write_blocked = false;
+                stream_progress(conn);
+            }
+            else if (conn->state == CONN_WRITING_RESPONSE)
+                handle_writable(conn);
+            else
+                handle_readable(conn);
+        }
+
+        // sent results free their admission, which a stream may be waiting on
+        resume_waiting_streams(loop);
+    }
+}
+
+/********************* [ io_uring backend ] ************************/
+
+// returns a free submission entry, flushing the queue to the kernel if it is full
+struct io_uring_sqe *next_sqe(event_loop_t *loop)
+{
+    struct io_uring_sqe *sqe;
+    while ((sqe = uring_get_sqe(&loop->ring)) == NULL)
+        uring_submit_and_wait(&loop->ring, 0);
+    return sqe;
+}
+
+void uring_queue_accept(event_loop_t *loop, int listen_fd)
 {
-    worker_thread_list[worker_num].available = true;
-    close(sockfd);
-    sem_post(&thread_number);
-    pthread_exit(NULL);
+    struct io_uring_sqe *sqe = next_sqe(loop);
+    sqe->opcode    = IORING_OP_ACCEPT;
+    sqe->fd        = listen_fd;
+    sqe->user_data = listen_fd == loop->local_fd ? URING_OP_ACCEPT_LOCAL : URING_OP_ACCEPT;
 }
 
-char *serialize_packet(packet_t *packet)
+void uring_queue_wake(event_loop_t *loop)
 {
-    packet->size = htons(packet->size);
-
-    char *serialized_data = malloc(sizeof(char) * PACKET_SIZE);
-    memset(serialized_data, '\0', PACKET_SIZE);
-    memcpy(serialized_data, packet, PACKET_SIZE);
-
-    return serialized_data;
+    struct io_uring_sqe *sqe = next_sqe(loop);
+    sqe->opcode    = IORING_OP_READ;
+    sqe->fd        = loop->wake_fd;
+    sqe->addr      = (uintptr_t)&loop->wake_count;
+    sqe->len       = sizeof(loop->wake_count);
+    sqe->user_data = URING_OP_WAKE;
 }
 
-packet_t *deserialize_data(char *serialized_data)
+void uring_queue_read(connection_t *conn)
 {
-    packet_t *packet = malloc(sizeof(char) * PACKET_SIZE);
-    memset(packet, 0, PACKET_SIZE);
-    memcpy(packet, serialized_data, PACKET_SIZE);
+    event_loop_t *loop = conn->loop;
 
-    packet->size = ntohs(packet->size);
+    if (conn->state == CONN_STREAMING && !stream_wants_input(conn))
+        return;
 
-    return packet;
-}
+    char *dest;
+    int remaining = next_input(conn, &dest);
+    if (remaining == 0)
+    {
+        // empty payload, nothing to wait for
+        if (consume_input(conn, 0) == 0)
+            uring_queue_read(conn);
+        return;
+    }
 
-int acknowledge(int sockfd, int new_size)
-{
-    packet_t packet;
-    packet.operation = IMG_OP_ACK;
-    packet.flags = 0;
-    packet.size = new_size;
+    struct io_uring_sqe *sqe = next_sqe(loop);
+    sqe->fd        = conn->sockfd;
+    sqe->addr      = (uintptr_t)dest;
+    sqe->len       = remaining;
+    sqe->user_data = (uintptr_t)conn | URING_OP_READ;
 
-    char *serialized_packet = serialize_packet(&packet);
-    if(send(sockfd, serialized_packet, PACKET_SIZE, 0) == -1)
+    if (conn->local && conn->state == CONN_READING_HEADER)
     {
-        free(serialized_packet);
-        return -1;
+        sqe->opcode    = IORING_OP_RECVMSG;
+        sqe->addr      = (uintptr_t)prepare_header_msg(conn, dest, remaining);
+        sqe->len       = 1;
+        sqe->msg_flags = MSG_CMSG_CLOEXEC;
     }
-    free(serialized_packet);
-    return 0;
+    else if (conn->state == CONN_READING_HEADER && conn->slot != -1 && loop->fixed_buffers)
+    {
+        sqe->opcode    = IORING_OP_READ_FIXED;
+        sqe->buf_index = 0;
+    }
+    else
+    {
+        // the kernel keeps receiving until the whole payload is in
+        sqe->opcode    = IORING_OP_RECV;
+        sqe->msg_flags = MSG_WAITALL;
+    }
+
+    conn->read_pending = true;
+    conn->pending_ops++;
 }
 
-void neg_acknowledge(int sockfd)
+void uring_queue_write(connection_t *conn)
 {
-    packet_t packet;
-    packet.operation = IMG_OP_NAK;
-    packet.flags = 0;
-    packet.size = 0;
+    event_loop_t *loop = conn->loop;
 
-    char *serialized_packet = serialize_packet(&packet);
-    if(send(sockfd, serialized_packet, PACKET_SIZE, 0) == -1)
+    struct iovec iov[2];
+    int iovcnt = next_output(conn, iov);
+
+    // packet and image go out as one linked chain in a single submission
+    for (int i = 0; i < iovcnt; i++)
     {
-        fprintf(stderr, "ERROR: Could not send negative acknowledgement\n");
+        struct io_uring_sqe *sqe = next_sqe(loop);
+        sqe->fd        = conn->sockfd;
+        sqe->addr      = (uintptr_t)iov[i].iov_base;
+        sqe->len       = iov[i].iov_len;
+        sqe->user_data = (uintptr_t)conn | URING_OP_WRITE;
+
+        bool packet = (char *)iov[i].iov_base >= conn->response &&
+                      (char *)iov[i].iov_base < conn->response + PACKET_SIZE;
+        if (packet && conn->slot != -1 && loop->fixed_buffers)
+        {
+            sqe->opcode    = IORING_OP_WRITE_FIXED;
+            sqe->buf_index = 0;
+        }
+        else if (!packet && loop->send_zc && !conn->local && iov[i].iov_len >= ZEROCOPY_MIN_BYTES)
+        {
+            // the image is freed only after the kernel's buffer notification comes back
+            sqe->opcode    = IORING_OP_SEND_ZC;
+            sqe->msg_flags = MSG_WAITALL;
+        }
+        else
+        {
+            sqe->opcode    = IORING_OP_SEND;
+            sqe->msg_flags = MSG_WAITALL;
+        }
+
+        if (i < iovcnt - 1)
+            sqe->flags |= IOSQE_IO_LINK;
+
+        conn->pending_ops++;
     }
-    free(serialized_packet);
 }
 
-int process_image(char *file_name, char *new_name, int angle)
+// a stream keeps a receive and a send queued at once, so each completion is acted on by itself
+void handle_stream_completion(connection_t *conn, int op, int res, uint32_t flags)
 {
-    int width;
-    int height;
-    int channels;
-    uint8_t *image_result = stbi_load(file_name, &width, &height, &channels, CHANNEL_NUM);
+    // a zero-copy send is done with once its buffer notification is in
+    if (op == URING_OP_WRITE && !(flags & IORING_CQE_F_MORE))
+        conn->write_ops--;
 
-    if (image_result == NULL)
+    if (conn->io_error)
     {
-        printf("Could not load image_result\n");
-        return -1;
+        if (op == URING_OP_WRITE)
+            fprintf(stderr, "ERROR: Could not send response\n");
+        abort_stream(conn);
+        return;
     }
-    
-    uint8_t **result_matrix = (uint8_t **)malloc(sizeof(uint8_t*) * width);
-    uint8_t **img_matrix    = (uint8_t **)malloc(sizeof(uint8_t*) * width);
-    for(int i = 0; i < width; i++)
+
+    if (op == URING_OP_READ && consume_input(conn, res) == -1)
+        return;
+    stream_progress(conn);
+}
+
+void handle_uring_completion(event_loop_t *loop, uint64_t user_data, int res, uint32_t flags)
+{
+    int op = user_data & URING_OP_MASK;
+
+    if (op == URING_OP_ACCEPT || op == URING_OP_ACCEPT_LOCAL)
     {
-        result_matrix[i] = (uint8_t *)malloc(sizeof(uint8_t) * height);
-        img_matrix[i]    = (uint8_t *)malloc(sizeof(uint8_t) * height);
+        if (res >= 0)
+        {
+            connection_t *conn = alloc_connection(loop, res);
+            conn->local = (op == URING_OP_ACCEPT_LOCAL);
+            uring_queue_read(conn);
+        }
+        else
+            fprintf(stderr, "ERROR: Accepting error\n");
+        uring_queue_accept(loop, op == URING_OP_ACCEPT_LOCAL ? loop->local_fd : loop->listen_fd);
+        return;
     }
-    
-    // load image into matrix
-    linear_to_image(image_result, img_matrix, width, height);
 
-    // flip image corresponding to angle requested
-    if (angle == 270)
+    if (op == URING_OP_WAKE)
     {
-        flip_upside_down(img_matrix, result_matrix ,width, height);
+        collect_finished_jobs(loop);
+        uring_queue_wake(loop);
+        return;
     }
-    else if (angle == 180)
+
+    connection_t *conn = (connection_t *)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+    conn->pending_ops--;
+    // a zero-copy send completes twice, the second time once its buffer is no longer needed
+    if (flags & IORING_CQE_F_MORE)
+        conn->pending_ops++;
+
+    if (res > 0 && op == URING_OP_WRITE)
+        conn->response_bytes += res;
+    else if (res <= 0 && res != -ECANCELED && !(flags & IORING_CQE_F_NOTIF))
+        conn->io_error = true;
+
+    if (op == URING_OP_READ)
+        conn->read_pending = false;
+
+    if (conn->state == CONN_STREAMING)
     {
-        flip_left_to_right(img_matrix, result_matrix, width, height);
+        handle_stream_completion(conn, op, res, flags);
+        return;
     }
 
-    uint8_t *img_array = malloc(sizeof(uint8_t) * width * height);
-
-    flatten_mat(result_matrix, img_array, width, height);
+    // wait for the rest of a linked chain before acting on the connection
+    if (conn->pending_ops > 0)
+        return;
 
-    // write image matrix to png
-    stbi_write_png(new_name, width, height, CHANNEL_NUM, img_array, width * CHANNEL_NUM);
+    if (conn->io_error)
+    {
+        // client went away, either mid-request or without sending IMG_OP_EXIT
+        if (op == URING_OP_WRITE)
+            fprintf(stderr, "ERROR: Could not send response\n");
+        close_connection(conn);
+        return;
+    }
 
-    // data clean up
-    for (int i = 0; i < width; i++)
+    if (op == URING_OP_READ)
     {
-        free(result_matrix[i]);
-        free(img_matrix[i]);
+        if (consume_input(conn, res) == 0)
+            uring_queue_read(conn);
+        return;
     }
-    free(img_matrix);
-    free(result_matrix);
-    free(img_array);
 
-    return 0;
+    struct iovec iov[2];
+    if (next_output(conn, iov) > 0)
+        uring_queue_write(conn);
+    else if (finish_response(conn) == 0)
+        uring_queue_read(conn);
 }
 
-void *client_handler(void *pargs)
+void run_uring_loop(event_loop_t *loop)
 {
-    processing_args_t *args = (processing_args_t *)pargs;
-    int sockfd = args->sockfd;
+    uring_queue_accept(loop, loop->listen_fd);
+    if (loop->local_fd != -1)
+        uring_queue_accept(loop, loop->local_fd);
+    uring_queue_wake(loop);
 
-    int worker_num = args->worker_num;
-
-    char recv_data[PACKET_SIZE];
-
-    while (true) // connection continues until terminated by client
+    while (true)
     {
-        memset(recv_data, '\0', PACKET_SIZE);
-
-        if(recv(sockfd, recv_data, PACKET_SIZE, 0) == -1)
+        // everything queued since the last pass goes to the kernel in one call
+        if (uring_submit_and_wait(&loop->ring, 1) == -1 && errno != EBUSY)
         {
-            fprintf(stderr, "ERROR: Could not receive packet\n");
-            neg_acknowledge(sockfd);
-            close_thread(worker_num, sockfd);
+            fprintf(stderr, "ERROR: io_uring_enter failed\n");
+            exit(1);
         }
 
-        // extract data from packet
-        packet_t *recv_packet = deserialize_data(recv_data);
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&loop->ring)) != NULL)
+        {
+            uint64_t user_data = cqe->user_data;
+            int      res       = cqe->res;
+            uint32_t flags     = cqe->flags;
+            uring_cqe_seen(&loop->ring);
 
-        if (recv_packet->operation == IMG_OP_EXIT)
-            break;
+            handle_uring_completion(loop, user_data, res, flags);
+        }
 
-        const int SIZE = recv_packet->size;
-        int rotation;
+        // sent results free their admission, which a stream may be waiting on
+        resume_waiting_streams(loop);
+    }
+}
 
-        if (recv_packet->flags == (recv_packet->flags & IMG_FLAG_ROTATE_180))
-            rotation = 180;
-        else if (recv_packet->flags == (recv_packet->flags & IMG_FLAG_ROTATE_270))
-            rotation = 270;
-        else
-        { 
-            fprintf(stderr, "ERROR: Invalid request\n");
-            neg_acknowledge(sockfd);
-            free(recv_packet);
-            close_thread(worker_num, sockfd);
-        }
+int init_uring_backend(event_loop_t *loop)
+{
+    if (uring_init(&loop->ring, URING_ENTRIES) == -1)
+        return -1;
 
-        free(recv_packet);
+    loop->conn_slab  = malloc(sizeof(connection_t) * URING_CONN_SLOTS);
+    loop->free_slots = malloc(sizeof(int) * URING_CONN_SLOTS);
+    if (loop->conn_slab == NULL || loop->free_slots == NULL)
+        return -1;
 
-        // create temporary (work) directory for storing temp files
-        char temp_dir_name[8];
-        memset(temp_dir_name, '\0', 8);
-        sprintf(temp_dir_name, "%d", worker_num);
-        if(mkdir(temp_dir_name, 0777) == -1)
-        {
-            fprintf(stderr, "ERROR: Could not create temp directory\n");
-        }
+    loop->num_free_slots = URING_CONN_SLOTS;
+    for (int i = 0; i < URING_CONN_SLOTS; i++)
+        loop->free_slots[i] = URING_CONN_SLOTS - 1 - i;
 
-        // prepare temporary file names
-        char temp_file_name[32];
-        char new_file_name[32];
-        memset(temp_file_name, '\0', 32);
-        memset(new_file_name, '\0', 32);
-        sprintf(temp_file_name, "%d/temp.png", worker_num);
-        sprintf(new_file_name, "%d/processed.png", worker_num);
+    struct iovec slab;
+    slab.iov_base = loop->conn_slab;
+    slab.iov_len  = sizeof(connection_t) * URING_CONN_SLOTS;
 
-        FILE *img_recv;
-        if ((img_recv = fopen(temp_file_name, "w+")) == NULL)
-        {
-            fprintf(stderr, "ERROR: Could not open output file location\n");
-            neg_acknowledge(sockfd);
-            rmdir(temp_dir_name);
-            close_thread(worker_num, sockfd);
-        }
+    loop->fixed_buffers = (uring_register_buffers(&loop->ring, &slab, 1) == 0);
+    if (!loop->fixed_buffers)
+        fprintf(stderr, "WARNING: Could not register io_uring buffers, using plain reads and writes\n");
 
-        // read input image data from socket
-        char buf[BUFF_SIZE];
-        int num_bytes = 0;
-        while (num_bytes < SIZE)
-        {
-            int new_bytes = read(sockfd, buf, BUFF_SIZE);
-            num_bytes += new_bytes;
-            fwrite(buf, sizeof(char), new_bytes, img_recv);
-        }
+    loop->send_zc = zerocopy_sends && uring_op_supported(&loop->ring, IORING_OP_SEND_ZC);
 
-        fclose(img_recv);
+    return 0;
+}
 
-        // do image processing
-        if (process_image(temp_file_name, new_file_name, rotation) == -1)
-        {
-            fprintf(stderr, "ERROR: could not process image\n");
-            neg_acknowledge(sockfd);
-            rmdir(temp_dir_name);
-            close_thread(worker_num, sockfd);
-        }
+void run_event_loop(event_loop_t *loop)
+{
+    if (loop->backend == BACKEND_URING)
+        run_uring_loop(loop);
+    else
+        run_epoll_loop(loop);
+}
 
-        FILE *processed_image;
-        if ((processed_image = fopen(new_file_name, "r")) == NULL)
-        {
-            fprintf(stderr, "ERROR: Could not open processed image\n");
-            neg_acknowledge(sockfd);
-            rmdir(temp_dir_name);
-            close_thread(worker_num, sockfd);
-        }
+int init_event_loop(event_loop_t *loop, int listen_fd, int local_fd, int backend)
+{
+    loop->backend   = backend;
+    loop->listen_fd = listen_fd;
+    loop->local_fd  = local_fd;
+    loop->done_jobs = NULL;
+    pthread_mutex_init(&loop->done_lock, NULL);
+    buffer_pool_init(&loop->buffers);
 
-        // get size of processed image
-        fseek(processed_image, 0, SEEK_END);
-        int new_size = ftell(processed_image);
-        fseek(processed_image, 0, SEEK_SET);
+    // io_uring honours O_NONBLOCK, so the wake-up read relies on a blocking eventfd
+    if ((loop->wake_fd = eventfd(0, 0)) == -1)
+        return -1;
 
-        if (acknowledge(sockfd, new_size) == -1)
-        {
-            fprintf(stderr, "ERROR: Could not send acknowledgement\n");
-            fclose(processed_image);
-            remove(temp_file_name);
-            remove(new_file_name);
-            rmdir(temp_dir_name);
-            close_thread(worker_num, sockfd);
-        }
+    if (backend == BACKEND_URING)
+        return init_uring_backend(loop);
 
-        // write processed image data to socket
-        num_bytes = 0;
-        while (num_bytes < new_size)
-        {
-            int new_bytes = fread(buf, sizeof(char), BUFF_SIZE, processed_image);
-            num_bytes += new_bytes;
-            write(sockfd, buf, new_bytes);
-        }
+    if ((loop->epoll_fd = epoll_create1(0)) == -1)
+        return -1;
 
-        // memory clean up
-        fclose(processed_image);
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
 
-        if (remove(temp_file_name) != 0)
-        {
-            fprintf(stderr, "ERROR: Could not delete pre-processed temp image\n");
-        }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->listen_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1)
+        return -1;
 
-        if (remove(new_file_name) != 0)
-        {
-            fprintf(stderr, "ERROR: Could not delete processed temp image\n");
-        }
+    if (local_fd != -1)
+    {
+        fcntl(local_fd, F_SETFL, fcntl(local_fd, F_GETFL) | O_NONBLOCK);
 
-        if (rmdir(temp_dir_name) == -1)
-        {
-            fprintf(stderr, "ERROR: Couldn't remove temp dir\n");
-            perror("rmdir");
-        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &loop->local_fd;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, local_fd, &ev) == -1)
+            return -1;
     }
 
-    close_thread(worker_num, sockfd);
-    return NULL;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->wake_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) == -1)
+        return -1;
+
+    return 0;
 }
 
-int main(int argc, char* argv[])
+int open_listener(bool reuse_port)
 {
-    // worker thread struct initialization
-    for (int i = 0; i < MAX_CLIENTS; i++)
-    {
-        worker_thread_list[i].available = true;
-        worker_thread_list[i].pargs.worker_num = i;
-    }
-
-    sem_init(&thread_number, 0, MAX_CLIENTS);
-
-    // Creating socket file descriptor
-    int listen_fd, conn_fd; // passive listening socket, 
+    int listen_fd; // passive listening socket
 
     // create listening socket
     if((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) 
     {
         fprintf(stderr, "ERROR: Socket error\n");
-        exit(1);
+        return -1;
+    }
+
+    // restart without waiting out TIME_WAIT, and let every shard bind the same port
+    int enable = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (reuse_port && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1)
+    {
+        fprintf(stderr, "ERROR: Could not enable SO_REUSEPORT\n");
+        close(listen_fd);
+        return -1;
     }
 
     struct sockaddr_in servaddr;
@@ -302,50 +2659,391 @@ int main(int argc, char* argv[])
     if(bind(listen_fd, (struct sockaddr *) &servaddr, sizeof(servaddr)) == -1)
     {
         fprintf(stderr, "ERROR: Bind error\n");
-        exit(1);
+        close(listen_fd);
+        return -1;
     }
 
     // listen on the listen_fd
-    if(listen(listen_fd, MAX_CLIENTS) == -1)
+    if(listen(listen_fd, LISTEN_BACKLOG) == -1)
     {
         fprintf(stderr, "ERROR: Listen error\n");
-        exit(1);
+        close(listen_fd);
+        return -1;
     }
 
-    while (true)
+    return listen_fd;
+}
+
+// listener for clients on this host, which can pass their files instead of sending the bytes
+int open_local_listener(const char *path)
+{
+    int listen_fd;
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
     {
-        struct sockaddr_in clientaddr;
-        socklen_t clientaddr_len = sizeof(clientaddr);
-        conn_fd = accept(listen_fd, (struct sockaddr *) &clientaddr, &clientaddr_len); // accept a request from a client
-        if(conn_fd == -1)
+        fprintf(stderr, "ERROR: Socket error\n");
+        return -1;
+    }
+
+    struct sockaddr_un servaddr;
+    memset(&servaddr, '\0', sizeof(servaddr));
+    servaddr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(servaddr.sun_path))
+    {
+        fprintf(stderr, "ERROR: Socket path %s is too long\n", path);
+        close(listen_fd);
+        return -1;
+    }
+    strcpy(servaddr.sun_path, path);
+
+    // a socket file left behind by an earlier run would make bind fail
+    unlink(path);
+
+    if (bind(listen_fd, (struct sockaddr *) &servaddr, sizeof(servaddr)) == -1)
+    {
+        fprintf(stderr, "ERROR: Bind error on %s\n", path);
+        close(listen_fd);
+        return -1;
+    }
+
+    if (listen(listen_fd, LISTEN_BACKLOG) == -1)
+    {
+        fprintf(stderr, "ERROR: Listen error\n");
+        close(listen_fd);
+        return -1;
+    }
+
+    return listen_fd;
+}
+
+// pins a new thread to its slot in an explicit CPU list, otherwise keeps it on its NUMA node
+void place_thread(pthread_t thread, const cpu_list_t *cpus, int slot, int node)
+{
+    int result = 0;
+    if (cpus->num_cpus > 0)
+        result = pin_thread(thread, cpus, slot);
+    else if (node != -1)
+        result = bind_thread(thread, &node_cpus[node]);
+
+    if (result == -1)
+        fprintf(stderr, "ERROR: Could not set thread affinity\n");
+}
+
+int init_shard(shard_t *shard, int first_worker, int queue_depth, int backend)
+{
+    const char *stage_names[NUM_STAGES] = { "decode", "transform", "encode" };
+    int (*stage_routines[NUM_STAGES])(job_t *, int) = { decode_image, transform_image, encode_image };
+
+    for (int i = 0; i < NUM_STAGES; i++)
+    {
+        stage_t *stage = &shard->stages[i];
+        stage->name      = stage_names[i];
+        stage->run       = stage_routines[i];
+        stage->processed = 0;
+        stage->next      = (i + 1 < NUM_STAGES) ? &shard->stages[i + 1] : NULL;
+
+        // admission keeps at most `queue_depth` images per shard, so a submission always finds room
+        if (scheduler_init(&stage->sched, stage->num_workers, queue_depth) == -1)
         {
-            fprintf(stderr, "ERROR: Accepting error\n");
-            exit(1);
+            fprintf(stderr, "ERROR: Could not create stage scheduler\n");
+            return -1;
         }
+    }
+
+    int listen_fd = open_listener(num_shards > 1);
+    if (listen_fd == -1)
+        return -1;
+
+    // a unix socket cannot be shared like SO_REUSEPORT, so local clients all go to the first shard
+    int local_fd = -1;
+    if (shard->shard_num == 0 && local_socket_path != NULL &&
+        (local_fd = open_local_listener(local_socket_path)) == -1)
+        return -1;
 
-        // wait for there to be an available thread
-        sem_wait(&thread_number);
+    // each shard multiplexes its own connections' socket I/O on a single thread
+    if (init_event_loop(&shard->loop, listen_fd, local_fd, backend) == -1)
+    {
+        fprintf(stderr, "ERROR: Could not create event loop\n");
+        return -1;
+    }
+    shard->loop.shard = shard;
 
-        for (int i = 0; i < MAX_CLIENTS; i++)
+    // start the worker pools before accepting any connections
+    for (int i = 0; i < NUM_STAGES; i++)
+    {
+        stage_t *stage = &shard->stages[i];
+        stage->workers = malloc(sizeof(worker_thread_t) * stage->num_workers);
+        for (int j = 0; j < stage->num_workers; j++)
         {
-            if (worker_thread_list[i].available)
+            stage->workers[j].worker_num = first_worker++;
+            stage->workers[j].index      = j;
+            stage->workers[j].stage      = stage;
+            if (pthread_create(&stage->workers[j].thread, NULL, worker_routine, &stage->workers[j]) != 0)
             {
-                worker_thread_list[i].available = false;
-                worker_thread_list[i].pargs.sockfd = conn_fd;
-                if ((worker_thread_list[i].thread = pthread_create(&worker_thread_list[i].thread, NULL, client_handler, &worker_thread_list[i].pargs)) != 0)
+                fprintf(stderr, "ERROR: Thread creation error\n");
+                return -1;
+            }
+
+            // encoding gets its own cores with -E, the cheaper stages share the -W ones
+            if (i == STAGE_ENCODE)
+                place_thread(stage->workers[j].thread, &encode_cpus, encode_slots++, shard->node);
+            else
+                place_thread(stage->workers[j].thread, &worker_cpus, worker_slots++, shard->node);
+        }
+    }
+
+    return 0;
+}
+
+void print_stats()
+{
+    for (int i = 0; i < num_shards; i++)
+    {
+        fprintf(stderr, "shard %d:", i);
+        for (int j = 0; j < NUM_STAGES; j++)
+        {
+            stage_t *stage = &shard_list[i].stages[j];
+            fprintf(stderr, " %s %d queued/%d workers/%ld done%s",
+                stage->name,
+                scheduler_pending(&stage->sched),
+                stage->num_workers,
+                __atomic_load_n(&stage->processed, __ATOMIC_RELAXED),
+                j + 1 < NUM_STAGES ? "," : "\n");
+        }
+
+        // under a steady load the malloc'd count stays flat while reused keeps climbing
+        buffer_pool_t *buffers = &shard_list[i].loop.buffers;
+        fprintf(stderr, "shard %d buffers: %ld requested/%ld reused/%ld malloc'd/%ld freed\n", i,
+            __atomic_load_n(&buffers->gets, __ATOMIC_RELAXED),
+            __atomic_load_n(&buffers->reused, __ATOMIC_RELAXED),
+            __atomic_load_n(&buffers->allocated, __ATOMIC_RELAXED),
+            __atomic_load_n(&buffers->released, __ATOMIC_RELAXED));
+    }
+}
+
+void *shard_routine(void *sargs)
+{
+    shard_t *shard = (shard_t *)sargs;
+    run_event_loop(&shard->loop);
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    int num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_band_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    int stage_workers[NUM_STAGES] = { 0, 0, 0 };
+    int queue_depth = DEFAULT_QUEUE_DEPTH;
+    long max_inflight_mb = DEFAULT_MAX_INFLIGHT_MB;
+    int backend = BACKEND_EPOLL;
+    int stats_interval = 0;
+    bool numa_placement = false;
+    num_shards = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:p:B:q:m:b:s:S:I:W:E:Ndu:zr:i")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                num_workers = atoi(optarg);
+                break;
+            case 'p':
+                if (sscanf(optarg, "%d:%d:%d", &stage_workers[STAGE_DECODE],
+                        &stage_workers[STAGE_TRANSFORM], &stage_workers[STAGE_ENCODE]) != NUM_STAGES ||
+                    stage_workers[STAGE_DECODE] < 1 || stage_workers[STAGE_TRANSFORM] < 1 || stage_workers[STAGE_ENCODE] < 1)
                 {
-                    fprintf(stderr, "ERROR: Thread creation error\n");
+                    fprintf(stderr, "ERROR: Stage workers must be given as decode:transform:encode\n");
                     exit(1);
                 }
-                pthread_detach(worker_thread_list[i].thread);
                 break;
-            }
+            case 'B':
+                num_band_threads = atoi(optarg);
+                break;
+            case 'q':
+                queue_depth = atoi(optarg);
+                break;
+            case 'm':
+                max_inflight_mb = atol(optarg);
+                break;
+            case 'b':
+                if (strcmp(optarg, "epoll") == 0)
+                    backend = BACKEND_EPOLL;
+                else if (strcmp(optarg, "uring") == 0)
+                    backend = BACKEND_URING;
+                else
+                {
+                    fprintf(stderr, "ERROR: Unknown I/O backend %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 's':
+                num_shards = atoi(optarg);
+                break;
+            case 'S':
+                stats_interval = atoi(optarg);
+                break;
+            case 'I':
+            case 'W':
+            case 'E':
+                if (parse_cpu_list(optarg, opt == 'I' ? &io_cpus : opt == 'W' ? &worker_cpus : &encode_cpus) == -1)
+                {
+                    fprintf(stderr, "ERROR: Malformed CPU list %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'N':
+                numa_placement = true;
+                break;
+            case 'd':
+                disk_staging = true;
+                break;
+            case 'u':
+                local_socket_path = strcmp(optarg, "none") == 0 ? NULL : optarg;
+                break;
+            case 'z':
+                zerocopy_sends = false;
+                break;
+            case 'r':
+                allowed_root = optarg;
+                break;
+            case 'i':
+                early_decoding = false;
+                break;
+            default:
+                fprintf(stderr, "Usage: ./server [-t num_workers] [-p decode:transform:encode] [-B band_threads] "
+                                "[-q queue_depth] [-m max_inflight_mb] [-b epoll|uring] [-s num_shards] [-S stats_seconds] "
+                                "[-I io_cpus] [-W worker_cpus] [-E encode_cpus] [-N] [-d] [-u socket_path|none] [-z] [-r allowed_root] [-i]\n");
+                exit(1);
+        }
+    }
+
+    if (num_workers < 1 || queue_depth < 1 || max_inflight_mb < 1 || num_shards < 1)
+    {
+        fprintf(stderr, "ERROR: Worker count, queue depth, in-flight limit and shard count must be positive\n");
+        exit(1);
+    }
+    if (num_band_threads < 0)
+        num_band_threads = 0;
+
+    // paths in requests are compared against the root with its symlinks already resolved
+    if (allowed_root != NULL &&
+        ((allowed_root = realpath(allowed_root, NULL)) == NULL ||
+         (allowed_root_fd = open(allowed_root, O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1))
+    {
+        fprintf(stderr, "ERROR: Could not open the allowed root\n");
+        exit(1);
+    }
+
+    // a client that disconnects mid-response must not take the server down
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGUSR1 is only ever taken by the main thread, which prints the pipeline stats
+    sigset_t stats_signals;
+    sigemptyset(&stats_signals);
+    sigaddset(&stats_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &stats_signals, NULL);
+
+    // with -N, shards are dealt out over the NUMA nodes and each keeps its threads and memory on its node
+    int num_nodes = 0;
+    if (numa_placement && (num_nodes = numa_topology(&numa_nodes, &node_cpus)) == 0)
+        fprintf(stderr, "ERROR: No NUMA topology found, threads are left unplaced\n");
+
+    cpu_set_t all_cpus;
+    pthread_getaffinity_np(pthread_self(), sizeof(all_cpus), &all_cpus);
+
+    num_band_pools = num_nodes > 0 ? num_nodes : 1;
+    band_pools = malloc(sizeof(band_pool_t) * num_band_pools);
+
+    shard_list = malloc(sizeof(shard_t) * num_shards);
+    int first_worker = 0;
+    for (int i = 0; i < num_shards; i++)
+    {
+        shard_list[i].shard_num = i;
+        shard_list[i].node      = num_nodes > 0 ? i % num_nodes : -1;
+        shard_list[i].band_pool = &band_pools[num_nodes > 0 ? i % num_nodes : 0];
+
+        // without -p, the shard's share of -t is split 1:1:2, encode being the expensive stage
+        int shard_workers = num_workers / num_shards + (i < num_workers % num_shards);
+        for (int j = 0; j < NUM_STAGES; j++)
+            shard_list[i].stages[j].num_workers = stage_workers[j];
+        if (stage_workers[STAGE_DECODE] == 0)
+        {
+            shard_list[i].stages[STAGE_DECODE].num_workers    = shard_workers / 4 > 0 ? shard_workers / 4 : 1;
+            shard_list[i].stages[STAGE_TRANSFORM].num_workers = shard_workers / 4 > 0 ? shard_workers / 4 : 1;
+            shard_list[i].stages[STAGE_ENCODE].num_workers    = shard_workers - 2 * (shard_workers / 4) > 0 ?
+                                                                shard_workers - 2 * (shard_workers / 4) : 1;
+        }
+
+        shard_list[i].num_workers = 0;
+        for (int j = 0; j < NUM_STAGES; j++)
+            shard_list[i].num_workers += shard_list[i].stages[j].num_workers;
+
+        shard_list[i].admission.max_jobs   = queue_depth;
+        shard_list[i].admission.max_bytes  = max_inflight_mb * 1024 * 1024;
+        shard_list[i].admission.jobs       = 0;
+        shard_list[i].admission.bytes      = 0;
+        shard_list[i].admission.avg_job_ms = 0;
+
+        // the shard's queues and connection slab are first touched here, so do it from its node
+        if (shard_list[i].node != -1)
+            bind_thread(pthread_self(), &node_cpus[shard_list[i].node]);
+        if (init_shard(&shard_list[i], first_worker, queue_depth, backend) == -1)
+            exit(1);
+        first_worker += shard_list[i].num_workers;
+    }
+
+    // the band helpers are split over the pools, each pool staying on its node
+    for (int i = 0; i < num_band_pools; i++)
+    {
+        int pool_threads = num_band_threads / num_band_pools + (i < num_band_threads % num_band_pools);
+        if (band_pool_init(&band_pools[i], pool_threads) == -1)
+        {
+            fprintf(stderr, "ERROR: Could not create band pool\n");
+            exit(1);
+        }
+        for (int j = 0; j < pool_threads; j++)
+            place_thread(band_pools[i].helpers[j].thread, &worker_cpus, worker_slots++, num_nodes > 0 ? i : -1);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(all_cpus), &all_cpus);
+
+    for (int i = 0; i < num_shards; i++)
+    {
+        if (pthread_create(&shard_list[i].thread, NULL, shard_routine, &shard_list[i]) != 0)
+        {
+            fprintf(stderr, "ERROR: Thread creation error\n");
+            exit(1);
         }
+        place_thread(shard_list[i].thread, &io_cpus, i, shard_list[i].node);
+    }
 
+    // print per-stage queue depths on SIGUSR1, and every -S seconds if asked to
+    while (true)
+    {
+        if (stats_interval > 0)
+        {
+            struct timespec timeout = { stats_interval, 0 };
+            sigtimedwait(&stats_signals, NULL, &timeout);
+        }
+        else
+        {
+            int sig;
+            sigwait(&stats_signals, &sig);
+        }
+        print_stats();
     }
 
     // data cleanup
-    sem_destroy(&thread_number);
-    close(listen_fd);
+    for (int i = 0; i < num_shards; i++)
+    {
+        for (int j = 0; j < NUM_STAGES; j++)
+        {
+            scheduler_destroy(&shard_list[i].stages[j].sched);
+            free(shard_list[i].stages[j].workers);
+        }
+        close(shard_list[i].loop.listen_fd);
+        if (shard_list[i].loop.local_fd != -1)
+            close(shard_list[i].loop.local_fd);
+    }
+    free(shard_list);
     return 0;
 }
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pack.h"
+
+// lists or extracts the images of a pack written by `./client -P`, checking every crc32
+
+int main(int argc, char *argv[])
+{
+    bool list_only = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "l")) != -1)
+    {
+        switch (opt)
+        {
+            case 'l':
+                list_only = true;
+                break;
+            default:
+                optind = argc + 1;   // falls into the usage message below
+                break;
+        }
+    }
+
+    if (argc - optind != (list_only ? 1 : 2))
+    {
+        fprintf(stderr, "Usage: ./unpack pack_file output_dir\n       ./unpack -l pack_file\n");
+        return 1;
+    }
+
+    char *pack_path = argv[optind];
+    char *output_dir = list_only ? NULL : argv[optind + 1];
+
+    int pack_fd = open(pack_path, O_RDONLY);
+    if (pack_fd == -1)
+    {
+        fprintf(stderr, "ERROR: Could not open %s\n", pack_path);
+        return 1;
+    }
+
+    pack_entry_t *entries;
+    int num_entries = pack_read_index(pack_fd, &entries);
+    struct stat pack_stat;
+    if (num_entries == -1 || fstat(pack_fd, &pack_stat) == -1)
+    {
+        fprintf(stderr, "ERROR: %s is not a valid pack\n", pack_path);
+        close(pack_fd);
+        return 1;
+    }
+
+    // the images are read straight out of the page cache
+    uint8_t *pack = mmap(NULL, pack_stat.st_size, PROT_READ, MAP_PRIVATE, pack_fd, 0);
+    close(pack_fd);
+    if (pack == MAP_FAILED)
+    {
+        fprintf(stderr, "ERROR: Could not map %s\n", pack_path);
+        pack_free_index(entries, num_entries);
+        return 1;
+    }
+
+    int bad = 0;
+    for (int i = 0; i < num_entries; i++)
+    {
+        pack_entry_t *entry = &entries[i];
+        bool intact = (pack_crc32(pack + entry->offset, entry->size) == entry->crc);
+        if (!intact)
+        {
+            fprintf(stderr, "ERROR: %s is corrupt\n", entry->name);
+            bad++;
+        }
+
+        if (list_only)
+        {
+            printf("%10llu  %08x  %s\n", (unsigned long long)entry->size, entry->crc, entry->name);
+            continue;
+        }
+
+        // names come from the pack, so they must not climb out of the output directory
+        if (!intact || strchr(entry->name, '/') != NULL || entry->name[0] == '.' || entry->name[0] == '\0')
+        {
+            if (intact)
+            {
+                fprintf(stderr, "ERROR: Refusing to extract %s\n", entry->name);
+                bad++;
+            }
+            continue;
+        }
+
+        const int OUT_PATH_LENGTH = strlen(output_dir) + strlen(entry->name) + 2;
+        char out_location[OUT_PATH_LENGTH];
+        sprintf(out_location, "%s/%s", output_dir, entry->name);
+
+        FILE *outfile;
+        if ((outfile = fopen(out_location, "w")) == NULL)
+        {
+            fprintf(stderr, "ERROR: Cannot open file location %s\n", out_location);
+            bad++;
+            continue;
+        }
+        if (fwrite(pack + entry->offset, sizeof(uint8_t), entry->size, outfile) != entry->size)
+        {
+            fprintf(stderr, "ERROR: Cannot write file location %s\n", out_location);
+            bad++;
+        }
+        fclose(outfile);
+    }
+
+    munmap(pack, pack_stat.st_size);
+    pack_free_index(entries, num_entries);
+    return bad > 0 ? 1 : 0;
+}
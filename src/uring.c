@@ -0,0 +1,141 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+int uring_init(uring_t *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(uring_t));
+
+    ring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->ring_fd == -1)
+        return -1;
+
+    // the submission and completion rings share one mapping (IORING_FEAT_SINGLE_MMAP)
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        close(ring->ring_fd);
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED)
+    {
+        close(ring->ring_fd);
+        return -1;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        munmap(ring->ring_ptr, ring->ring_size);
+        close(ring->ring_fd);
+        return -1;
+    }
+
+    char *base = ring->ring_ptr;
+    ring->sq_head    = (unsigned *)(base + params.sq_off.head);
+    ring->sq_tail    = (unsigned *)(base + params.sq_off.tail);
+    ring->sq_mask    = (unsigned *)(base + params.sq_off.ring_mask);
+    ring->sq_array   = (unsigned *)(base + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+
+    ring->cq_head = (unsigned *)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(base + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(base + params.cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+
+    return 0;
+}
+
+void uring_destroy(uring_t *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring_ptr, ring->ring_size);
+    close(ring->ring_fd);
+}
+
+int uring_register_buffers(uring_t *ring, struct iovec *iovs, unsigned nr)
+{
+    if (syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_BUFFERS, iovs, nr) == -1)
+        return -1;
+    return 0;
+}
+
+int uring_op_supported(uring_t *ring, int op)
+{
+    const unsigned nr_ops = 256;
+    struct io_uring_probe *probe = calloc(1, sizeof(struct io_uring_probe) + nr_ops * sizeof(struct io_uring_probe_op));
+    if (probe == NULL)
+        return 0;
+
+    int supported = 0;
+    if (syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_PROBE, probe, nr_ops) == 0 &&
+        op <= probe->last_op)
+        supported = (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+
+    free(probe);
+    return supported;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->to_submit;
+
+    if (tail - head >= ring->sq_entries)
+        return NULL;
+
+    unsigned index = tail & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    ring->to_submit++;
+
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr)
+{
+    unsigned submitted = ring->to_submit;
+
+    // publish the new entries before the kernel looks at the tail
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + submitted, __ATOMIC_RELEASE);
+    ring->to_submit = 0;
+
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    // entries the kernel already consumed are not submitted twice on retry
+    while (syscall(__NR_io_uring_enter, ring->ring_fd, submitted, wait_nr, flags, NULL, 0) == -1)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+
+    return submitted;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}